@@ -0,0 +1,172 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "../src/cel0.h"
+
+/* Runs each workload at growing sizes and prints a JSON report of the wall
+   time, allocations and peak RSS of every run. Each run forks, so its peak
+   RSS is its own. Names given as arguments select the workloads to run. */
+
+typedef struct Workload {
+  char* name;
+  /* printf format of the program, given the size, or the path of the
+     generated file if the workload reads one. */
+  char* program;
+  void (*generate)(FILE* file, int size);
+  int sizes[3];
+} Workload;
+
+static void generateDigits(FILE* file, int size) {
+  for (int i=0; i<size; i++)
+    fputc('0' + i % 10, file);
+  fputc(' ', file);
+}
+
+static void generateBytes(FILE* file, int size) {
+  for (int i=0; i<size; i++)
+    fputc(i * 7 % 256, file);
+}
+
+static Workload workloads[] = {
+  { "fib",
+    "(bind (fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (add (fib (add n -1)) (fib (add n -2))))))) (fib %d))",
+    0, { 20, 24, 28 } },
+  { "fib-it",
+    "(bind (fib-it (lambda (it n1 n2) (if (eq it 0) n2 (fib-it (add it -1) n2 (add n1 n2))))) (fib-it %d 0 1))",
+    0, { 10000, 100000, 1000000 } },
+  { "filter",
+    "(bind"
+    " (ones-between (lambda (it n acc) (if (eq it n) acc (ones-between (add it 1) n (append (append acc 1) it)))))"
+    " (filter-out-1s (lambda (v it res)"
+    "   (if (eq (length v) it) res"
+    "     (bind (el (nth it v)) (filter-out-1s v (add it 1) (if (eq el 1) res (append res el)))))))"
+    " (length (filter-out-1s (ones-between 0 %d (vec)) 0 (vec))))",
+    0, { 1000, 10000, 100000 } },
+  { "parse-int",
+    "(bind"
+    " (range (lambda (b e) (bind (range-acc (lambda (b e acc) (if (eq b e) acc (range-acc (add b 1) e (append acc b)))))"
+    "                         (range-acc b e (vec)))))"
+    " (contains (lambda (x buff it)"
+    "   (if (eq it (length buff)) (quote false) (if (eq (nth it buff) x) (quote true) (contains x buff (add it 1))))))"
+    " (int-chars (range 48 58))"
+    " (parse-int-acc (lambda (buff it acc)"
+    "   (if (eq it (length buff)) acc"
+    "     (if (contains (nth it buff) int-chars 0)"
+    "       (parse-int-acc buff (add 1 it) (add (mul acc 10) (add (nth it buff) -48)))"
+    "       acc))))"
+    " (parse-int-acc (open-file! (quote %s)) 0 0))",
+    generateDigits, { 10000, 50000, 250000 } },
+  { "add-file-chars",
+    "(bind"
+    " (add-chars (lambda (buffer it sum) (if (eq it (length buffer)) sum (add-chars buffer (add it 1) (add sum (nth it buffer))))))"
+    " (add-chars (open-file! (quote %s)) 0 0))",
+    generateBytes, { 1<<20, 1<<21, 1<<22 } },
+  { "vsum-file-chars",
+    "(vsum (open-file! (quote %s)))",
+    generateBytes, { 1<<22, 1<<24, 1<<26 } },
+  { "sort",
+    "(vsum (sort (vmul (range 0 %1$d) (range 0 %1$d))))",
+    0, { 100000, 1000000, 4000000 } },
+};
+
+static double now() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec + time.tv_nsec * 1e-9;
+}
+
+static void printJsonString(char* string) {
+  putchar('"');
+  for (; *string; string++) {
+    if (*string == '"' || *string == '\\') putchar('\\');
+    putchar(*string);
+  }
+  putchar('"');
+}
+
+/* Runs in a child process, whose exit status tells whether it panicked. */
+static int runWorkload(Workload* workload, int size, char* path) {
+  char* program = 0;
+  size_t program_size = 0;
+  FILE* program_file = open_memstream(&program, &program_size);
+  if (workload->generate) fprintf(program_file, workload->program, path);
+  else fprintf(program_file, workload->program, size);
+  fclose(program_file);
+
+  cel0_Context* context = cel0_createContext();
+  double start = now();
+  cel0_Value* result = cel0_eval(context, cel0_parse(context, program));
+  double wall = now() - start;
+  char* printed = 0;
+  size_t printed_size = 0;
+  FILE* printed_file = open_memstream(&printed, &printed_size);
+  cel0_printValue(context, result, printed_file);
+  fclose(printed_file);
+
+  struct rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  printf("    { \"name\": \"%s\", \"n\": %d, \"wall_seconds\": %.6f, \"allocations\": %lld, \"peak_rss_kb\": %ld, \"result\": ",
+	 workload->name, size, wall, cel0_allocations(context), usage.ru_maxrss);
+  printJsonString(printed);
+  printf(" }");
+  fflush(stdout);
+
+  int panicked = result->type == cel0_ValueType_Panic;
+  free(printed);
+  cel0_destroyContext(context);
+  free(program);
+  return panicked;
+}
+
+static int selected(Workload* workload, int argc, char* argv[]) {
+  if (argc == 1) return 1;
+  for (int i=1; i<argc; i++)
+    if (strcmp(argv[i], workload->name) == 0) return 1;
+  return 0;
+}
+
+int main(int argc, char* argv[]) {
+  char directory[] = "/tmp/cel0-workloads-XXXXXX";
+  if (!mkdtemp(directory)) {
+    perror("mkdtemp");
+    return 1;
+  }
+  int failures = 0, runs = 0;
+  printf("{\n  \"workloads\": [");
+  for (unsigned i=0; i<sizeof(workloads)/sizeof(workloads[0]); i++) {
+    Workload* workload = workloads + i;
+    if (!selected(workload, argc, argv)) continue;
+    for (int j=0; j<3; j++) {
+      char path[sizeof(directory) + 32] = "";
+      if (workload->generate) {
+	sprintf(path, "%s/%s-%d", directory, workload->name, j);
+	FILE* file = fopen(path, "wb");
+	if (!file) {
+	  perror(path);
+	  return 1;
+	}
+	workload->generate(file, workload->sizes[j]);
+	fclose(file);
+      }
+
+      printf("%s\n", runs++ ? "," : "");
+      fflush(stdout);
+      pid_t child = fork();
+      if (child == 0) exit(runWorkload(workload, workload->sizes[j], path));
+      int status;
+      if (child < 0 || waitpid(child, &status, 0) != child || !WIFEXITED(status) || WEXITSTATUS(status) != 0) {
+	fprintf(stderr, "%s %d failed\n", workload->name, workload->sizes[j]);
+	failures++;
+      }
+      if (workload->generate) remove(path);
+    }
+  }
+  printf("\n  ]\n}\n");
+  rmdir(directory);
+  return failures != 0;
+}
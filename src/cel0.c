@@ -1,92 +1,551 @@
 #include "cel0.h"
 
 #include <assert.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__x86_64__) && !defined(CEL0_NO_SIMD)
+#include <immintrin.h>
+#define cel0_Simd 1
+#endif
+
+/* Values returned by the create* functions are scratch: callers copy them
+   before the machine reaches a safepoint, where the collector hands all of
+   them out again. Values that must live longer are malloc'd. */
+#define cel0_ValueChunkSize (1<<12)
+typedef struct cel0_ValueChunk {
+  struct cel0_ValueChunk* next;
+  cel0_Value values[cel0_ValueChunkSize];
+} cel0_ValueChunk;
+
+typedef struct cel0_SymbolArena {
+  struct cel0_SymbolArena* previous;
+  char names[];
+} cel0_SymbolArena;
+
+/* What mem-stats! reports, counted under lock. Values of every type are
+   counted as they are created; vectors and panics also while their
+   metadata is live. Bytes are those of the element buffers, which free
+   metadata slots keep for reuse, and of the files mapped by open-file!. */
+typedef struct cel0_MemoryStats {
+  long long allocated[4];
+  int live[4];
+  int peak[4];
+  long long buffer_bytes;
+  long long peak_buffer_bytes;
+  long long mapped_bytes;
+  long long peak_mapped_bytes;
+  long long symbol_bytes;
+  int peak_scratch_values;
+} cel0_MemoryStats;
+
+/* What the collector must see of a thread evaluating in a context: its
+   innermost machine, which links the machines of its callers, and the
+   values its natives keep alive. */
+typedef struct cel0_Roots {
+  struct cel0_Machine* machine;
+  cel0_Value* pinned;
+  int pinned_size;
+  int pinned_capacity;
+} cel0_Roots;
+
+/* Everything an interpreter allocates. The context of the calling thread is
+   current while a public function runs, so contexts used by different
+   threads share no mutable state. */
+struct cel0_Context {
+  cel0_ValueChunk* value_chunks;
+  cel0_ValueChunk* value_chunk;
+  int value_chunk_size;
+  /* Read at every safepoint, including those of pool workers. */
+  atomic_int allocations_since_collection;
+  long long allocations;
+  cel0_MemoryStats memory;
+
+  /* Names live in a chunked arena, so they never move once interned. */
+  cel0_SymbolArena* symbol_arena;
+  int symbol_arena_size;
+  int symbol_arena_capacity;
+  char** symbol_names;
+  int* symbol_lengths;
+  unsigned* symbol_hashes;
+  int symbol_number;
+  int symbol_capacity;
+  /* Open addressing with linear probing; slots hold symbol_id + 1. */
+  int* symbol_table;
+  int symbol_table_capacity;
+
+  struct cel0_VectorMetadata* vector_metadata;
+  int vector_metadata_number;
+  /* Collected ids are chained through their size field. */
+  int free_vector_metadata;
+  int live_vector_metadata_number;
+
+  /* Every compiled code object, whose constants are roots for the collector. */
+  struct cel0_Code** codes;
+  int codes_size;
+  int codes_capacity;
+
+  int collection_threshold;
+  int* mark_stack;
+  int mark_stack_capacity;
+
+  cel0_Value* place_holder_for_recursion;
+  cel0_SymbolBindingStack global_bindings;
+  cel0_Value result;
+
+  /* Of the thread that owns the context. */
+  cel0_Roots roots;
+
+  /* While pool workers run, parallel is set, whatever they share is
+     changed under lock, and a collection waits until every worker is at
+     a safepoint. */
+  struct cel0_Pool* pool;
+  pthread_mutex_t lock;
+  char parallel;
+
+  /* Set while profiling, which evaluates everything on one thread. */
+  struct cel0_Profile* profile;
+};
+
+static _Thread_local cel0_Context* g_context = 0;
+static _Thread_local cel0_Roots* g_roots = 0;
+
+static cel0_Context* enterContext(cel0_Context* context) {
+  cel0_Context* previous = g_context;
+  g_context = context;
+  g_roots = context ? &context->roots : 0;
+  return previous;
+}
+
+static void lockContext() {
+  if (g_context->parallel) pthread_mutex_lock(&g_context->lock);
+}
+
+static void unlockContext() {
+  if (g_context->parallel) pthread_mutex_unlock(&g_context->lock);
+}
+
+/* Allocations are counted under lock, so relaxed accesses only keep the
+   reads at safepoints well-defined. */
+static int allocationsSinceCollection() {
+  return atomic_load_explicit(&g_context->allocations_since_collection, memory_order_relaxed);
+}
+
+static void countAllocation() {
+  g_context->allocations++;
+  atomic_store_explicit(&g_context->allocations_since_collection, allocationsSinceCollection() + 1,
+			memory_order_relaxed);
+}
+
+static cel0_Value* allocateValue() {
+  lockContext();
+  if (!g_context->value_chunk || g_context->value_chunk_size == cel0_ValueChunkSize) {
+    cel0_ValueChunk* next = g_context->value_chunk ? g_context->value_chunk->next : g_context->value_chunks;
+    if (!next) {
+      next = malloc(sizeof(cel0_ValueChunk));
+      assert(next);
+      next->next = 0;
+      if (g_context->value_chunk) g_context->value_chunk->next = next;
+      else g_context->value_chunks = next;
+    }
+    g_context->value_chunk = next;
+    g_context->value_chunk_size = 0;
+  }
+  countAllocation();
+  cel0_Value* value = g_context->value_chunk->values + g_context->value_chunk_size++;
+  unlockContext();
+  return value;
+}
+
+/* The number of scratch values handed out since the last collection,
+   which it also records as the peak if it is. */
+static int scratchValues() {
+  if (!g_context->value_chunk) return 0;
+  int values = g_context->value_chunk_size;
+  for (cel0_ValueChunk* chunk = g_context->value_chunks; chunk != g_context->value_chunk; chunk = chunk->next)
+    values += cel0_ValueChunkSize;
+  if (values > g_context->memory.peak_scratch_values) g_context->memory.peak_scratch_values = values;
+  return values;
+}
+
+static void freeAllValues() {
+  g_context->value_chunk = 0;
+  g_context->value_chunk_size = 0;
+}
+
+static cel0_Value* createPermanentValue(cel0_Value* value) {
+  cel0_Value* permanent = malloc(sizeof(cel0_Value));
+  assert(permanent);
+  *permanent = *value;
+  return permanent;
+}
+
+static cel0_Value numberValue(int number) {
+  return (cel0_Value) { .type = cel0_ValueType_Number, .u = { .number = number } };
+}
+
+static cel0_Value symbolValue(int symbol_id) {
+  return (cel0_Value) { .type = cel0_ValueType_Symbol, .u = { .symbol_id = symbol_id } };
+}
+
+static void countValue(int type) {
+  lockContext();
+  g_context->memory.allocated[type]++;
+  unlockContext();
+}
+
+static void countBytes(long long* bytes, long long* peak, long long change) {
+  *bytes += change;
+  if (*bytes > *peak) *peak = *bytes;
+}
 
 cel0_Value* createNumberValue(int number) {
-  cel0_Value* value = malloc(sizeof(cel0_Value));
-  assert(value);
-  value->type = cel0_ValueType_Number;
-  value->u.number = number;
+  cel0_Value* value = allocateValue();
+  *value = numberValue(number);
+  countValue(cel0_ValueType_Number);
   return value;
 }
 
-#define cel0_MaxSymbolLength 32
-#define cel0_MaxSymbols (1<<10)
+/* Symbols interned before any other, so their ids are constants. */
+#define cel0_Symbol_True 0
+#define cel0_Symbol_False 1
+#define cel0_Symbol_SelfRec 2
+static char* g_builtin_symbols[] = { "true", "false", "#self-rec" };
 
-static char g_symbols[cel0_MaxSymbols][cel0_MaxSymbolLength];
-static int g_symbol_number = 0;
+#define cel0_SymbolArenaChunkSize (1<<16)
 
-static int internSymbol(char* name) {
-  assert(strlen(name) < cel0_MaxSymbolLength);
-  for (int i=0; i<g_symbol_number; i++) {
-    if (strcmp(g_symbols[i], name) == 0)
-      return i;
+static unsigned hashSymbolName(char* name, int length) {
+  unsigned hash = 2166136261u;
+  for (int i=0; i<length; i++) {
+    hash ^= (unsigned char)name[i];
+    hash *= 16777619u;
+  }
+  return hash;
+}
+
+static void insertSymbolInTable(int symbol_id) {
+  unsigned mask = g_context->symbol_table_capacity - 1;
+  unsigned slot = g_context->symbol_hashes[symbol_id] & mask;
+  while (g_context->symbol_table[slot]) slot = (slot + 1) & mask;
+  g_context->symbol_table[slot] = symbol_id + 1;
+}
+
+static void growSymbolTable() {
+  free(g_context->symbol_table);
+  g_context->symbol_table_capacity = g_context->symbol_table_capacity ? g_context->symbol_table_capacity * 2 : 1<<10;
+  g_context->symbol_table = calloc(g_context->symbol_table_capacity, sizeof(int));
+  assert(g_context->symbol_table);
+  for (int i=0; i<g_context->symbol_number; i++)
+    insertSymbolInTable(i);
+}
+
+static char* copyToSymbolArena(char* name, int length) {
+  if (g_context->symbol_arena_size + length + 1 > g_context->symbol_arena_capacity) {
+    g_context->symbol_arena_capacity = length + 1 > cel0_SymbolArenaChunkSize ? length + 1 : cel0_SymbolArenaChunkSize;
+    cel0_SymbolArena* arena = malloc(sizeof(cel0_SymbolArena) + g_context->symbol_arena_capacity);
+    assert(arena);
+    arena->previous = g_context->symbol_arena;
+    g_context->symbol_arena = arena;
+    g_context->symbol_arena_size = 0;
+  }
+  char* copy = g_context->symbol_arena->names + g_context->symbol_arena_size;
+  memcpy(copy, name, length);
+  copy[length] = 0;
+  g_context->symbol_arena_size += length + 1;
+  g_context->memory.symbol_bytes += length + 1;
+  return copy;
+}
+
+static int internSymbolWithLength(char* name, int length);
+static void internBuiltinSymbols() {
+  growSymbolTable();
+  for (unsigned i=0; i<sizeof(g_builtin_symbols)/sizeof(g_builtin_symbols[0]); i++) {
+    int symbol_id = internSymbolWithLength(g_builtin_symbols[i], strlen(g_builtin_symbols[i]));
+    assert(symbol_id == (int)i);
+    (void)symbol_id;
+  }
+}
+
+static int internSymbolWithLength(char* name, int length) {
+  lockContext();
+  if (!g_context->symbol_table_capacity) internBuiltinSymbols();
+  unsigned hash = hashSymbolName(name, length);
+  unsigned mask = g_context->symbol_table_capacity - 1;
+  for (unsigned slot = hash & mask; g_context->symbol_table[slot]; slot = (slot + 1) & mask) {
+    int symbol_id = g_context->symbol_table[slot] - 1;
+    if (g_context->symbol_hashes[symbol_id] == hash && g_context->symbol_lengths[symbol_id] == length &&
+	memcmp(g_context->symbol_names[symbol_id], name, length) == 0) {
+      unlockContext();
+      return symbol_id;
+    }
   }
-  assert(g_symbol_number < cel0_MaxSymbols && "Reached maximum number of symbols.");
 
-  strcpy(g_symbols[g_symbol_number], name);
-  return g_symbol_number++;
+  int symbol_id = g_context->symbol_number;
+  if (symbol_id == g_context->symbol_capacity) {
+    g_context->symbol_capacity = g_context->symbol_capacity ? g_context->symbol_capacity * 2 : 1<<10;
+    g_context->symbol_names = realloc(g_context->symbol_names, g_context->symbol_capacity * sizeof(char*));
+    g_context->symbol_lengths = realloc(g_context->symbol_lengths, g_context->symbol_capacity * sizeof(int));
+    g_context->symbol_hashes = realloc(g_context->symbol_hashes, g_context->symbol_capacity * sizeof(unsigned));
+    assert(g_context->symbol_names && g_context->symbol_lengths && g_context->symbol_hashes);
+  }
+  g_context->symbol_names[symbol_id] = copyToSymbolArena(name, length);
+  g_context->symbol_lengths[symbol_id] = length;
+  g_context->symbol_hashes[symbol_id] = hash;
+  g_context->symbol_number++;
+  if (2 * g_context->symbol_number > g_context->symbol_table_capacity)
+    growSymbolTable();
+  else
+    insertSymbolInTable(symbol_id);
+  unlockContext();
+  return symbol_id;
+}
+
+static int internSymbol(char* name) {
+  return internSymbolWithLength(name, strlen(name));
 }
 
 static char* lookupSymbolName(int symbol_id) {
-  assert(symbol_id < g_symbol_number);
-  return g_symbols[symbol_id];
+  lockContext();
+  assert(symbol_id < g_context->symbol_number);
+  char* name = g_context->symbol_names[symbol_id];
+  unlockContext();
+  return name;
 }
 
 static cel0_Value* createPanicValue(char* symbol);
+static cel0_Value* createSymbolValueFromId(int symbol_id) {
+  cel0_Value* value = allocateValue();
+  *value = symbolValue(symbol_id);
+  countValue(cel0_ValueType_Symbol);
+  return value;
+}
+
 static cel0_Value* createSymbolValue(char* name) {
   assert(name);
-  cel0_Value* value = malloc(sizeof(cel0_Value));
-  assert(value);
-  value->type = cel0_ValueType_Symbol;
-  value->u.symbol_id = internSymbol(name);
-  return value;
+  return createSymbolValueFromId(internSymbol(name));
 }
 
+/* Element storage. append derives a vector from another by writing past
+   its end when it is the newest version over the buffer (its size equals
+   used), so a chain of appends shares one buffer and old versions stay
+   valid. */
+typedef struct cel0_VectorBuffer {
+  int references;
+  int used;
+  int capacity;
+  cel0_Value values[];
+} cel0_VectorBuffer;
+
 #define cel0_MaxVectorMetadataLength (1<<20)
+struct cel0_Function;
+struct cel0_MemoCache;
 typedef struct cel0_VectorMetadata {
+  /* Elements of buffer, cached since every reader needs them. */
   cel0_Value* vector;
   int size;
+  cel0_VectorBuffer* buffer;
+  /* Read-only file mapping of a byte vector, whose elements are the bytes
+     as numbers. vector stays null until something needs the elements as
+     values and widens it. Readers that peek take no lock, so they load
+     bytes once and only follow vector after seeing it cleared. */
+  unsigned char* _Atomic bytes;
+  /* The mapping bytes viewed, which outlives widening until no reader
+     can still be using it. */
+  unsigned char* mapping;
+  struct cel0_Function* function;
+  /* Results of a closure built by memo-lambda. */
+  struct cel0_MemoCache* memo;
+  char live;
+  char marked;
+  /* Vector or panic, for mem-stats!. */
+  char type;
 } cel0_VectorMetadata;
-cel0_VectorMetadata g_vector_metadata[cel0_MaxVectorMetadataLength];
 
-static int g_vector_metadata_number = 0;
-static int createVectorMetadata() {
-  assert(g_vector_metadata_number < cel0_MaxVectorMetadataLength && "Reached maximum number of values.");
-  memset(g_vector_metadata + g_vector_metadata_number, 0, sizeof(cel0_VectorMetadata));
-  return g_vector_metadata_number++;
+static int createVectorMetadata(int type) {
+  lockContext();
+  int vector_id = g_context->free_vector_metadata;
+  if (vector_id >= 0) {
+    g_context->free_vector_metadata = g_context->vector_metadata[vector_id].size;
+  } else {
+    assert(g_context->vector_metadata_number < cel0_MaxVectorMetadataLength && "Reached maximum number of values.");
+    vector_id = g_context->vector_metadata_number++;
+  }
+  cel0_VectorMetadata* metadata = g_context->vector_metadata + vector_id;
+  /* A reused id keeps the element buffer it was collected with. */
+  cel0_VectorBuffer* buffer = metadata->buffer;
+  memset(metadata, 0, sizeof(cel0_VectorMetadata));
+  metadata->buffer = buffer;
+  metadata->vector = buffer ? buffer->values : 0;
+  metadata->live = 1;
+  metadata->type = type;
+  g_context->live_vector_metadata_number++;
+  cel0_MemoryStats* memory = &g_context->memory;
+  memory->allocated[type]++;
+  if (++memory->live[type] > memory->peak[type]) memory->peak[type] = memory->live[type];
+  countAllocation();
+  unlockContext();
+  return vector_id;
+}
+
+/* Unlike lookupVectorMetadata, leaves byte vectors packed. */
+static cel0_VectorMetadata* peekVectorMetadata(int vector_id) {
+  assert(g_context->vector_metadata[vector_id].live);
+  return g_context->vector_metadata + vector_id;
 }
 
+static void widenByteVector(cel0_VectorMetadata* metadata);
 static cel0_VectorMetadata* lookupVectorMetadata(int vector_id) {
-  assert(vector_id < g_vector_metadata_number);
-  return g_vector_metadata + vector_id;
+  cel0_VectorMetadata* metadata = peekVectorMetadata(vector_id);
+  if (metadata->bytes) {
+    lockContext();
+    if (metadata->bytes) widenByteVector(metadata);
+    unlockContext();
+  }
+  return metadata;
 }
 
-static cel0_Value* createVectorValue() {
-  cel0_Value* value = malloc(sizeof(cel0_Value));
-  assert(value);
-  value->type = cel0_ValueType_Vector;  
-  value->u.vector_id = createVectorMetadata();
+#define cel0_MinVectorCapacity 4
+
+static void releaseVectorBuffer(cel0_VectorMetadata* metadata) {
+  lockContext();
+  if (metadata->buffer && --metadata->buffer->references == 0) {
+    g_context->memory.buffer_bytes -= sizeof(cel0_VectorBuffer) + metadata->buffer->capacity * sizeof(cel0_Value);
+    free(metadata->buffer);
+  }
+  metadata->buffer = 0;
+  metadata->vector = 0;
+  unlockContext();
+}
+
+/* A slice views its buffer from offset elements in. */
+static int vectorOffset(cel0_VectorMetadata* metadata) {
+  return metadata->buffer ? metadata->vector - metadata->buffer->values : 0;
+}
+
+/* Records that the vector now ends the used part of its buffer. */
+static void claimVectorBuffer(cel0_VectorMetadata* metadata) {
+  metadata->buffer->used = vectorOffset(metadata) + metadata->size;
+}
+
+/* Makes room for capacity elements that the vector may write past its end.
+   Buffers grow geometrically, so appending one element at a time is
+   amortized O(1); the first allocation is exact for sized vectors. A
+   shared buffer the vector cannot extend is copied instead. */
+static void reserveVectorCapacity(cel0_VectorMetadata* metadata, int capacity) {
+  lockContext();
+  cel0_VectorBuffer* buffer = metadata->buffer;
+  int offset = vectorOffset(metadata);
+  char exclusive = buffer && buffer->references == 1;
+  char extendable = exclusive || (buffer && buffer->used == offset + metadata->size);
+  if (extendable && offset + capacity <= buffer->capacity) {
+    unlockContext();
+    return;
+  }
+  int new_capacity = buffer ? buffer->capacity * 2 : 0;
+  if (new_capacity < capacity) new_capacity = capacity;
+  size_t buffer_size = sizeof(cel0_VectorBuffer) + new_capacity * sizeof(cel0_Value);
+  cel0_MemoryStats* memory = &g_context->memory;
+  if (exclusive && !offset) {
+    countBytes(&memory->buffer_bytes, &memory->peak_buffer_bytes, (long long)(new_capacity - buffer->capacity) * sizeof(cel0_Value));
+    buffer = realloc(buffer, buffer_size);
+    assert(buffer);
+  } else {
+    countBytes(&memory->buffer_bytes, &memory->peak_buffer_bytes, buffer_size);
+    cel0_VectorBuffer* copy = malloc(buffer_size);
+    assert(copy);
+    copy->references = 1;
+    if (metadata->size)
+      memcpy(copy->values, metadata->vector, metadata->size * sizeof(cel0_Value));
+    releaseVectorBuffer(metadata);
+    buffer = copy;
+  }
+  buffer->capacity = new_capacity;
+  buffer->used = metadata->size;
+  metadata->buffer = buffer;
+  metadata->vector = buffer->values;
+  unlockContext();
+}
+
+/* Creates a vector of size elements, which the caller fills in. */
+static cel0_Value* createVectorValueWithSize(int type, int size) {
+  cel0_Value* value = allocateValue();
+  value->type = type;
+  value->u.vector_id = createVectorMetadata(type);
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
+  reserveVectorCapacity(metadata, size > cel0_MinVectorCapacity ? size : cel0_MinVectorCapacity);
+  metadata->size = size;
+  claimVectorBuffer(metadata);
+  return value;
+}
+
+static void unmapByteVector(cel0_VectorMetadata* metadata) {
+  munmap(metadata->mapping, metadata->size);
+  g_context->memory.mapped_bytes -= metadata->size;
+  metadata->mapping = 0;
+  metadata->bytes = 0;
+}
+
+/* Called under lock. The elements are built aside and published before
+   bytes is cleared, so a worker peeking meanwhile sees either whole
+   representation; the mapping it may still be reading is only unmapped
+   once no worker runs. */
+static void widenByteVector(cel0_VectorMetadata* metadata) {
+  unsigned char* bytes = metadata->bytes;
+  int size = metadata->size;
+  size_t buffer_size = sizeof(cel0_VectorBuffer) + size * sizeof(cel0_Value);
+  cel0_VectorBuffer* buffer = malloc(buffer_size);
+  assert(buffer);
+  countBytes(&g_context->memory.buffer_bytes, &g_context->memory.peak_buffer_bytes, buffer_size);
+  buffer->references = 1;
+  buffer->capacity = size;
+  buffer->used = size;
+  for (int i=0; i<size; i++)
+    buffer->values[i] = numberValue(bytes[i]);
+  metadata->buffer = buffer;
+  metadata->vector = buffer->values;
+  metadata->bytes = 0;
+  if (!g_context->parallel) unmapByteVector(metadata);
+}
+
+/* Creates a vector viewing size elements of buffer from offset on. */
+static cel0_Value* createVectorValueSharing(cel0_VectorBuffer* buffer, int offset, int size) {
+  assert(offset + size <= buffer->used);
+  cel0_Value* value = allocateValue();
+  value->type = cel0_ValueType_Vector;
+  value->u.vector_id = createVectorMetadata(cel0_ValueType_Vector);
   cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
-  metadata->vector = malloc(0);
-  metadata->size = 0;
+  releaseVectorBuffer(metadata);
+  lockContext();
+  buffer->references++;
+  unlockContext();
+  metadata->buffer = buffer;
+  metadata->vector = buffer->values + offset;
+  metadata->size = size;
   return value;
 }
 
+static cel0_Value* createVectorValue() {
+  return createVectorValueWithSize(cel0_ValueType_Vector, 0);
+}
+
 static cel0_Value* appendValueToVectorInPlace(cel0_Value* vector, cel0_Value* value) {
   assert(vector);
   assert(value);
   assert(vector->type == cel0_ValueType_Vector || vector->type == cel0_ValueType_Panic);
 
   cel0_VectorMetadata* metadata = lookupVectorMetadata(vector->u.vector_id);
-  int new_size = metadata->size + 1;
-  metadata->vector = realloc(metadata->vector, new_size * sizeof(cel0_Value));
-  assert(metadata->vector);
-  metadata->vector[metadata->size] = *value;
-  metadata->size = new_size;
+  reserveVectorCapacity(metadata, metadata->size + 1);
+  metadata->vector[metadata->size++] = *value;
+  claimVectorBuffer(metadata);
   return vector;
 }
 
@@ -98,37 +557,27 @@ static cel0_Value* concatVectorsInPlace(cel0_Value* dest_vector, cel0_Value* app
   cel0_VectorMetadata* dest_vector_metadata = lookupVectorMetadata(dest_vector->u.vector_id);
   cel0_VectorMetadata* append_metadata = lookupVectorMetadata(append->u.vector_id);
   int new_size = dest_vector_metadata->size + append_metadata->size;
-  dest_vector_metadata->vector = realloc(dest_vector_metadata->vector, new_size * sizeof(cel0_Value));
-  assert(new_size == 0 || dest_vector_metadata->vector);
-  memcpy(dest_vector_metadata->vector + dest_vector_metadata->size, append_metadata->vector, append_metadata->size * sizeof(cel0_Value));
+  reserveVectorCapacity(dest_vector_metadata, new_size);
+  if (append_metadata->size)
+    memcpy(dest_vector_metadata->vector + dest_vector_metadata->size, append_metadata->vector, append_metadata->size * sizeof(cel0_Value));
   dest_vector_metadata->size = new_size;
+  claimVectorBuffer(dest_vector_metadata);
   return dest_vector;
 }
 
 static cel0_Value* createPanicValue(char* symbol) {
-  cel0_Value* value = malloc(sizeof(cel0_Value));
-  assert(value);
-  value->type = cel0_ValueType_Panic;  
-  value->u.vector_id = createVectorMetadata();
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
-  metadata->vector = createSymbolValue(symbol);
-  assert(metadata->vector && metadata->vector->type == cel0_ValueType_Symbol);
-  metadata->size = 1;
+  cel0_Value* value = createVectorValueWithSize(cel0_ValueType_Panic, 1);
+  lookupVectorMetadata(value->u.vector_id)->vector[0] = *createSymbolValue(symbol);
   return value;
 }
 
 static cel0_Value* createPanicValueWithParam(char* symbol, cel0_Value* param) {
   assert(param);
-  cel0_Value* value = malloc(sizeof(cel0_Value));
-  assert(value);
-  value->type = cel0_ValueType_Panic;  
-  value->u.vector_id = createVectorMetadata();
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
-  metadata->vector = createVectorValue();
-  metadata->size = 1;  
-  assert(metadata->vector);
-  metadata->vector = appendValueToVectorInPlace(metadata->vector, createSymbolValue(symbol));
-  metadata->vector = appendValueToVectorInPlace(metadata->vector, param);  
+  cel0_Value* entry = createVectorValue();
+  entry = appendValueToVectorInPlace(entry, createSymbolValue(symbol));
+  entry = appendValueToVectorInPlace(entry, param);
+  cel0_Value* value = createVectorValueWithSize(cel0_ValueType_Panic, 1);
+  lookupVectorMetadata(value->u.vector_id)->vector[0] = *entry;
   return value;
 }
 
@@ -150,12 +599,9 @@ static cel0_Value* parseNumber(char** code) {
 static cel0_Value* parseSymbol(char** code) {
   char end[] = " \f\n\r\t\v)(\0";
   int length = strcspn(*code, end);
-  char name[cel0_MaxSymbolLength];
-  strncpy(name, *code, length);
-  name[length] = 0;  
-  if (length >= cel0_MaxSymbolLength) return createPanicValueWithParam("symbol-too-long", createSymbolValue(name));  
+  cel0_Value* value = createSymbolValueFromId(internSymbolWithLength(*code, length));
   *code += length;
-  return createSymbolValue(name);
+  return value;
 }
 
 static cel0_Value* parse(char** code) {
@@ -181,11 +627,111 @@ static cel0_Value* parse(char** code) {
   return value;
 }
 
-cel0_Value* cel0_parse(char* code) {
-  return parse(&code);
+cel0_Value* cel0_parse(cel0_Context* context, char* code) {
+  cel0_Context* previous = enterContext(context);
+  cel0_Value* value = parse(&code);
+  enterContext(previous);
+  return value;
+}
+
+/* Reads input in chunks and cuts it into top-level forms, so only the text
+   of the form being read is buffered. The scan state survives refills:
+   begin is the start of the pending form, scanned how far it was checked. */
+#define cel0_ReaderChunkSize (1<<16)
+struct cel0_Reader {
+  cel0_Context* context;
+  FILE* file;
+  char* buffer;
+  int size;
+  int capacity;
+  int begin;
+  int scanned;
+  int depth;
+  char in_atom;
+};
+
+cel0_Reader* cel0_createReader(cel0_Context* context, FILE* file) {
+  cel0_Reader* reader = calloc(1, sizeof(cel0_Reader));
+  assert(reader);
+  reader->context = context;
+  reader->file = file;
+  return reader;
+}
+
+void cel0_destroyReader(cel0_Reader* reader) {
+  free(reader->buffer);
+  free(reader);
+}
+
+static int fillReader(cel0_Reader* reader) {
+  if (reader->begin > 0) {
+    memmove(reader->buffer, reader->buffer + reader->begin, reader->size - reader->begin);
+    reader->size -= reader->begin;
+    reader->scanned -= reader->begin;
+    reader->begin = 0;
+  }
+  if (reader->capacity - reader->size < cel0_ReaderChunkSize + 1) {
+    reader->capacity = reader->capacity ? reader->capacity * 2 : cel0_ReaderChunkSize + 1;
+    reader->buffer = realloc(reader->buffer, reader->capacity);
+    assert(reader->buffer);
+  }
+  int read = fread(reader->buffer + reader->size, 1, cel0_ReaderChunkSize, reader->file);
+  reader->size += read;
+  return read;
+}
+
+/* Returns the end of the pending form once it is complete, or -1. Stray
+   closing parentheses between forms are skipped. */
+static int scanForm(cel0_Reader* reader) {
+  char whitespaces[] = " \f\n\r\t\v";
+  for (; reader->scanned < reader->size; reader->scanned++) {
+    char c = reader->buffer[reader->scanned];
+    char delimiter = c == '(' || c == ')' || strchr(whitespaces, c);
+    if (reader->in_atom && delimiter) return reader->scanned;
+    if (reader->depth == 0 && !reader->in_atom) {
+      if (c == ')' || strchr(whitespaces, c))
+	reader->begin = reader->scanned + 1;
+      else if (c == '(')
+	reader->depth = 1;
+      else
+	reader->in_atom = 1;
+    } else if (reader->depth > 0) {
+      if (c == '(') reader->depth++;
+      if (c == ')' && --reader->depth == 0) return reader->scanned + 1;
+    }
+  }
+  return -1;
+}
+
+cel0_Value* cel0_read(cel0_Reader* reader) {
+  int end = scanForm(reader);
+  while (end < 0) {
+    if (fillReader(reader) == 0) {
+      if (reader->depth > 0) {
+	reader->begin = reader->scanned = reader->size;
+	reader->depth = 0;
+	cel0_Context* previous = enterContext(reader->context);
+	cel0_Value* panic = createPanicValue("unterminated-form");
+	enterContext(previous);
+	return panic;
+      }
+      if (!reader->in_atom) return 0;
+      end = reader->size;
+      break;
+    }
+    end = scanForm(reader);
+  }
+  char saved = reader->buffer[end];
+  reader->buffer[end] = 0;
+  cel0_Value* value = cel0_parse(reader->context, reader->buffer + reader->begin);
+  reader->buffer[end] = saved;
+  reader->begin = reader->scanned = end;
+  reader->depth = 0;
+  reader->in_atom = 0;
+  return value;
 }
 
-void cel0_printValue(cel0_Value* value, FILE* fd) {
+static void printValue(cel0_Value* value, FILE* fd) {
   assert (value->type == cel0_ValueType_Vector ||
 	  value->type == cel0_ValueType_Number ||
 	  value->type == cel0_ValueType_Symbol ||
@@ -193,9 +739,11 @@ void cel0_printValue(cel0_Value* value, FILE* fd) {
   if (value->type == cel0_ValueType_Vector || value->type == cel0_ValueType_Panic) {
     char panic = value->type == cel0_ValueType_Panic;
     fprintf(fd,  panic ? "<" : "(");
-    cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
+    cel0_VectorMetadata* metadata = peekVectorMetadata(value->u.vector_id);
+    unsigned char* bytes = metadata->bytes;
     for (int i=0; i<metadata->size; i++) {
-      cel0_printValue(metadata->vector + i, fd);
+      if (bytes) fprintf(fd, "%d", bytes[i]);
+      else printValue(metadata->vector + i, fd);
       if (i != metadata->size - 1)
 	fprintf(fd, " ");              
     }
@@ -207,186 +755,82 @@ void cel0_printValue(cel0_Value* value, FILE* fd) {
   }
 }
 
-static cel0_SymbolBinding* lookupSymbolBinding(cel0_Value* key, cel0_SymbolBindingStack* stack) {
-  assert(key->type == cel0_ValueType_Symbol);
-  for (int i=stack->size-1; i>=stack->begin; i-=1) {
-    cel0_SymbolBinding* binding = stack->frames + i;
-    assert(binding->symbol->type == cel0_ValueType_Symbol);
-    if (binding->symbol->u.symbol_id == key->u.symbol_id) {
-      return binding;
-    }
-  }
-  for (int i=0; i<stack->global_size; i++) {
-    cel0_SymbolBinding* binding = stack->frames + i;
-    assert(binding->symbol->type == cel0_ValueType_Symbol);
-    if (binding->symbol->u.symbol_id == key->u.symbol_id) {
-      return binding;
-    }
-  }
-  return 0;
+void cel0_printValue(cel0_Context* context, cel0_Value* value, FILE* fd) {
+  cel0_Context* previous = enterContext(context);
+  printValue(value, fd);
+  enterContext(previous);
 }
 
-static cel0_Value* placeHolderForRecursion() {
-  static cel0_Value* place_holder_for_recursion = 0;
-  if (!place_holder_for_recursion) {
-    place_holder_for_recursion  = createSymbolValue("#self-rec");
+/* Makes frames[index] the innermost binding of its symbol. Each binding
+   remembers the one it shadows, so popping restores the previous one. */
+static void linkSymbolBinding(cel0_SymbolBindingStack* stack, int index) {
+  cel0_SymbolBinding* binding = stack->frames + index;
+  assert(binding->symbol->type == cel0_ValueType_Symbol);
+  int symbol_id = binding->symbol->u.symbol_id;
+  if (symbol_id >= stack->innermost_capacity) {
+    int capacity = stack->innermost_capacity ? stack->innermost_capacity : 1<<10;
+    while (capacity <= symbol_id) capacity *= 2;
+    stack->innermost = realloc(stack->innermost, capacity * sizeof(int));
+    assert(stack->innermost);
+    memset(stack->innermost + stack->innermost_capacity, 0,
+	   (capacity - stack->innermost_capacity) * sizeof(int));
+    stack->innermost_capacity = capacity;
   }
-  return place_holder_for_recursion;
+  binding->shadowed = stack->innermost[symbol_id];
+  stack->innermost[symbol_id] = index + 1;
 }
 
-static cel0_Value* eval(cel0_Value* value, cel0_SymbolBindingStack* stack);
-static cel0_Value* apply(cel0_Value* expression, cel0_Value* parameters, cel0_SymbolBindingStack* stack) {
-  assert(expression && expression->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* expression_metadata = lookupVectorMetadata(expression->u.vector_id);
-  if (expression_metadata->size != 2 ||
-      expression_metadata->vector[0].type != cel0_ValueType_Vector)
-    return createPanicValue("ill-formed");
-  cel0_VectorMetadata* lambda_list_metadata =
-    lookupVectorMetadata(expression_metadata->vector->u.vector_id);  
-  assert(parameters->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* parameters_metadata = lookupVectorMetadata(parameters->u.vector_id);
-  int number_param = 0;
-  for (; lambda_list_metadata->vector[number_param].type == cel0_ValueType_Symbol  &&
-	 number_param<lambda_list_metadata->size; number_param++);
-
-  if (number_param != parameters_metadata->size)
-    return createPanicValue("number-params");
-
-  int caller_stack_begin = stack->begin;
-  stack->begin = stack->size;
-  for (int i=0; i<lambda_list_metadata->size; i++) {
-    assert(stack->size < stack->capacity);
-    cel0_SymbolBinding* binding = stack->frames + stack->size;
-    binding->type = cel0_SymbolBindingType_Expression;
-    if (i<number_param) {
-      binding->symbol = lambda_list_metadata->vector + i;
-      binding->u.expression = parameters_metadata->vector + i;
-    } else {
-      assert(lambda_list_metadata->vector[i].type == cel0_ValueType_Vector);
-      cel0_VectorMetadata* param_metadata =
-	lookupVectorMetadata(lambda_list_metadata->vector[i].u.vector_id);
-      assert(param_metadata->size == 2);
-      assert(param_metadata->vector->type == cel0_ValueType_Symbol);
-      binding->symbol = param_metadata->vector;
-      binding->u.expression = param_metadata->vector + 1;
-    }
-    stack->size++;
-  }
+static cel0_SymbolBinding* pushSymbolBinding(cel0_SymbolBindingStack* stack, cel0_Value* symbol,
+					     cel0_Value* expression) {
   assert(stack->size < stack->capacity);
   cel0_SymbolBinding* binding = stack->frames + stack->size;
   binding->type = cel0_SymbolBindingType_Expression;
-  binding->symbol = placeHolderForRecursion();
+  binding->symbol = symbol;
+  binding->constant = 0;
   binding->u.expression = expression;
-  stack->size++;
-  cel0_Value* result = eval(expression_metadata->vector + 1, stack);
-  stack->size = stack->begin;
-  stack->begin = caller_stack_begin;
-  return result;
+  linkSymbolBinding(stack, stack->size++);
+  return binding;
 }
 
-static cel0_Value* createEvalPanicStackEntry(cel0_Value* symbol, cel0_Value* parameters) {
-  cel0_Value* stack_entry = appendValueToVectorInPlace(createVectorValue(), symbol);
-  assert(parameters->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(parameters->u.vector_id);
-  for (int i=0; i<metadata->size; i++) {
-    stack_entry = appendValueToVectorInPlace(stack_entry, metadata->vector + i);
+static void popSymbolBindings(cel0_SymbolBindingStack* stack, int size) {
+  assert(size <= stack->size);
+  while (stack->size > size) {
+    cel0_SymbolBinding* binding = stack->frames + --stack->size;
+    stack->innermost[binding->symbol->u.symbol_id] = binding->shadowed;
   }
-  return stack_entry;
 }
 
-static cel0_Value* eval(cel0_Value* value, cel0_SymbolBindingStack* stack) {
-  assert(value);
-  assert(stack);
-
-  if (value->type == cel0_ValueType_Vector) {
-    cel0_VectorMetadata* value_metadata = lookupVectorMetadata(value->u.vector_id);
-    if (value_metadata->size == 0) return createPanicValue("empty-vec");
+/* Visible bindings are the locals of the innermost function, [begin, size),
+   and the globals, [0, global_size). Locals of enclosing functions are
+   skipped: lambdas see them only through captures. */
+static cel0_SymbolBinding* lookupSymbolBinding(cel0_Value* key, cel0_SymbolBindingStack* stack) {
+  assert(key->type == cel0_ValueType_Symbol);
+  if (key->u.symbol_id >= stack->innermost_capacity) return 0;
+  int index = stack->innermost[key->u.symbol_id] - 1;
+  while (index >= stack->global_size && index < stack->begin)
+    index = stack->frames[index].shadowed - 1;
+  return index < 0 ? 0 : stack->frames + index;
+}
 
-    assert(value_metadata->size > 0);
-    if (value_metadata->vector->type != cel0_ValueType_Symbol) return createPanicValue("not-symbol");
-    
-    cel0_SymbolBinding* binding = lookupSymbolBinding(value_metadata->vector, stack);
-    if(!binding) return createPanicValueWithParam("unbound", value_metadata->vector);
-    
-    cel0_Value* parameters = createVectorValue();
-    char eval_parameters =
-      binding->type == cel0_SymbolBindingType_Native ||
-      binding->type == cel0_SymbolBindingType_Expression;
-    for (int i=1; i<value_metadata->size; i++) {
-      cel0_Value* p = eval_parameters ?
-	eval(value_metadata->vector + i, stack) :
-	(value_metadata->vector + i);
-      if (p->type == cel0_ValueType_Panic) return p;
-
-      parameters = appendValueToVectorInPlace(parameters, p);
-    }
-    if (binding->type == cel0_SymbolBindingType_TransformNative ||
-	binding->type == cel0_SymbolBindingType_Native) {
-      cel0_Value* ret =  binding->u.native.expression(parameters, stack);
-      if (ret->type == cel0_ValueType_Panic)
-	return appendValueToVectorInPlace(ret, createEvalPanicStackEntry(binding->symbol, parameters));
-      return ret;
-    } else {
-      assert(binding->type == cel0_SymbolBindingType_Expression);
-      cel0_Value* expression = binding->u.expression;
-      if (expression->type == cel0_ValueType_Symbol && expression->u.symbol_id == placeHolderForRecursion()->u.symbol_id) {
-	cel0_SymbolBinding* self_rec_binding = lookupSymbolBinding(expression, stack);
-	if (!self_rec_binding) return createPanicValue("self-rec-binding");
-	assert(self_rec_binding->type == cel0_SymbolBindingType_Expression);
-	expression = self_rec_binding->u.expression;
-      }
-      cel0_Value* ret = apply(expression, parameters, stack);
-      if (ret->type == cel0_ValueType_Panic)
-	return appendValueToVectorInPlace(ret, createEvalPanicStackEntry(binding->symbol, parameters));
-      return ret;
-    }
-  } else if (value->type == cel0_ValueType_Number) {
-    return value;
-  } else if (value->type == cel0_ValueType_Symbol) {
-    cel0_SymbolBinding* binding = lookupSymbolBinding(value, stack);
-    if (!binding) return createPanicValueWithParam("unbound", value);
-    if (binding->type == cel0_SymbolBindingType_Expression) {
-      return binding->u.expression;
-    } else if (binding->type == cel0_SymbolBindingType_Native ||
-	       binding->type == cel0_SymbolBindingType_TransformNative ){
-      char name[cel0_MaxSymbolLength];
-      sprintf(name, binding->type == cel0_SymbolBindingType_Native ? "@%p" : "#%p", (void*)(binding->u.expression));
-      return createSymbolValue(name);
-    }
+static cel0_Value* placeHolderForRecursion() {
+  lockContext();
+  if (!g_context->place_holder_for_recursion) {
+    g_context->place_holder_for_recursion  = createPermanentValue(createSymbolValueFromId(cel0_Symbol_SelfRec));
   }
-  assert(0);
+  unlockContext();
+  return g_context->place_holder_for_recursion;
 }
 
-static cel0_Value* bind(cel0_Value* params, cel0_SymbolBindingStack* stack) {
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
-  if (params_metadata->size < 2) return createPanicValueWithParam("ill-formed", params);
-  int caller_stack_size = stack->size;
-  for (int i=0; i<params_metadata->size-1; i+=1) {
-    if (params_metadata->vector[i].type != cel0_ValueType_Vector) return createPanicValueWithParam("ill-formed", params);
-    cel0_VectorMetadata* binding_metadata =
-      lookupVectorMetadata(params_metadata->vector[i].u.vector_id);    
-
-    if (binding_metadata->size != 2 || binding_metadata->vector->type != cel0_ValueType_Symbol)
-      return createPanicValue("ill-formed");
-
-    assert(stack->size < stack->capacity);
-    cel0_SymbolBinding* binding = stack->frames + stack->size;    
-    binding->type = cel0_SymbolBindingType_Expression;
-    binding->symbol = binding_metadata->vector;
-    binding->u.expression = placeHolderForRecursion();
-    stack->size++;
-    cel0_Value* bound_expression = eval(binding_metadata->vector + 1, stack);
-    if (bound_expression->type == cel0_ValueType_Panic) return bound_expression;    
-    binding->u.expression = bound_expression;    
-  }
 
-  cel0_Value* result = eval(params_metadata->vector + params_metadata->size - 1, stack);
-  stack->size = caller_stack_size;
-  return result;
+static cel0_Value* createCallPanicStackEntry(cel0_Value* head, cel0_Value* arguments, int argument_count) {
+  cel0_Value* stack_entry = createVectorValueWithSize(cel0_ValueType_Vector, argument_count + 1);
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(stack_entry->u.vector_id);
+  metadata->vector[0] = *head;
+  memcpy(metadata->vector + 1, arguments, argument_count * sizeof(cel0_Value));
+  return stack_entry;
 }
 
+
 static cel0_Value* captureLexicalBindings(cel0_Value* expression, cel0_SymbolBindingStack* stack) {
   assert(expression);
   if (expression->type == cel0_ValueType_Symbol) {
@@ -400,15 +844,15 @@ static cel0_Value* captureLexicalBindings(cel0_Value* expression, cel0_SymbolBin
   } else if (expression->type == cel0_ValueType_Vector) {
     cel0_VectorMetadata* expression_metadata = lookupVectorMetadata(expression->u.vector_id);
     if (expression_metadata->size == 0) return createPanicValue("empty-vec");
-    if (expression_metadata->vector->type != cel0_ValueType_Symbol) createPanicValue("not-symbol");
+    if (expression_metadata->vector->type != cel0_ValueType_Symbol) return createPanicValue("not-symbol");
     cel0_SymbolBinding* binding = lookupSymbolBinding(expression_metadata->vector, stack);
     if (!binding) return createPanicValueWithParam("unbound", expression_metadata->vector);
     if (binding->type == cel0_SymbolBindingType_TransformNative) {
-      assert(binding->u.native.captureLexicalBindings);
+      assert(binding->u.transform.captureLexicalBindings);
       cel0_Value* params = createVectorValue();
       for (int i=1; i<expression_metadata->size; i++)
 	params = appendValueToVectorInPlace(params, expression_metadata->vector + i);
-      return binding->u.native.captureLexicalBindings(params, stack);
+      return binding->u.transform.captureLexicalBindings(params, stack);
     } else {
       cel0_Value* result = createVectorValue();      
       for (int i=0; i<expression_metadata->size; i++) {
@@ -433,29 +877,32 @@ static cel0_Value* bindCaptureLexicalBindings(cel0_Value* params, cel0_SymbolBin
   cel0_Value* result = createVectorValue();
   int caller_stack_size = stack->size;
   for (int i=0; i<params_metadata->size-1; i++) {
-    if (params_metadata->vector[i].type != cel0_ValueType_Vector) return createPanicValueWithParam("ill-formed", params);
+    if (params_metadata->vector[i].type != cel0_ValueType_Vector) {
+      popSymbolBindings(stack, caller_stack_size);
+      return createPanicValueWithParam("ill-formed", params);
+    }
     cel0_VectorMetadata* binding_metadata =
       lookupVectorMetadata(params_metadata->vector[i].u.vector_id);    
 
-    if (binding_metadata->size != 2 || binding_metadata->vector->type != cel0_ValueType_Symbol)
+    if (binding_metadata->size != 2 || binding_metadata->vector->type != cel0_ValueType_Symbol) {
+      popSymbolBindings(stack, caller_stack_size);
       return createPanicValue("ill-formed");
+    }
 
-    assert(stack->size < stack->capacity);
-    cel0_SymbolBinding* binding = stack->frames + stack->size;
-    binding->type = cel0_SymbolBindingType_Expression;
-    binding->symbol = binding_metadata->vector;
-    binding->u.expression = placeHolderForRecursion();
-    stack->size++;    
+    cel0_SymbolBinding* binding = pushSymbolBinding(stack, binding_metadata->vector, placeHolderForRecursion());
     cel0_Value* bindings = captureLexicalBindings(binding_metadata->vector + 1, stack);
-    if (bindings->type == cel0_ValueType_Panic) return bindings;
+    if (bindings->type == cel0_ValueType_Panic) {
+      popSymbolBindings(stack, caller_stack_size);
+      return bindings;
+    }
     binding->u.expression = binding_metadata->vector;
     result = concatVectorsInPlace(result, bindings);
 
   }
   cel0_Value* body_bindings = captureLexicalBindings(params_metadata->vector + params_metadata->size - 1,stack);
+  popSymbolBindings(stack, caller_stack_size);
   if (body_bindings->type == cel0_ValueType_Panic) return body_bindings;  
   result = concatVectorsInPlace(result, body_bindings);
-  stack->size = caller_stack_size;
   return result;
 }
 
@@ -495,259 +942,3337 @@ static cel0_Value* lambdaCaptureLexicalBindings(cel0_Value* params, cel0_SymbolB
       return createPanicValueWithParam("lambda-list-ill-formed", lambda_list_metadata->vector + i);
   }
   int caller_stack_size = stack->size;
-  for (int i=0; i<lambda_list_metadata->size; i++) {
-    assert(stack->size < stack->capacity);    
-    cel0_SymbolBinding* binding = stack->frames + stack->size;
-    binding->type = cel0_SymbolBindingType_Expression;
-    binding->symbol = lambda_list_metadata->vector + i;
-    binding->u.expression = lambda_list_metadata->vector + i;
-    stack->size++;
-  }
+  for (int i=0; i<lambda_list_metadata->size; i++)
+    pushSymbolBinding(stack, lambda_list_metadata->vector + i, lambda_list_metadata->vector + i);
 
   cel0_Value* body_bindings = captureLexicalBindings(params_metadata->vector + 1, stack);
-  stack->size = caller_stack_size;
+  popSymbolBindings(stack, caller_stack_size);
   
   return body_bindings;
 }
 
-static cel0_Value* lambda(cel0_Value* params, cel0_SymbolBindingStack* stack) {
-  assert(params);
-  assert(stack);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(params->u.vector_id);  
-  if (metadata->size != 2 || 
-      metadata->vector[0].type != cel0_ValueType_Vector) {
-    return createPanicValue("ill-formed");
-  }
-
-  cel0_VectorMetadata* lambda_list_metadata = lookupVectorMetadata(metadata->vector->u.vector_id);    
-  for (int i=0; i<lambda_list_metadata->size; i++) {
-    if (lambda_list_metadata->vector[i].type != cel0_ValueType_Symbol)
-      return createPanicValueWithParam("lambda-list-ill-formed", lambda_list_metadata->vector + i);
+static cel0_Value* memoLambdaCaptureLexicalBindings(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
+  if (params_metadata->size == 3 && params_metadata->vector[0].type == cel0_ValueType_Number) {
+    cel0_Value* lambda_params = appendValueToVectorInPlace(createVectorValue(), params_metadata->vector + 1);
+    params = appendValueToVectorInPlace(lambda_params, params_metadata->vector + 2);
   }
-  cel0_Value* params_with_capture = createVectorValue();
-  params_with_capture = concatVectorsInPlace(params_with_capture, metadata->vector);
-  cel0_Value* captures = lambdaCaptureLexicalBindings(params, stack);
-  if (captures->type == cel0_ValueType_Panic) return captures;
-  params_with_capture = concatVectorsInPlace(params_with_capture, captures);
-
-  cel0_Value* result = createVectorValue();
-  result = appendValueToVectorInPlace(result, params_with_capture);
-  return appendValueToVectorInPlace(result, metadata->vector + 1);
-}
-
-static cel0_Value* quote(cel0_Value* params, cel0_SymbolBindingStack* stack) {
-  assert(params);
-  assert(stack);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(params->u.vector_id);
-  if (metadata->size != 1) return createPanicValue("quote-ill-formed");
-
-  return metadata->vector;
-}
-
-static cel0_Value* ifStatement(cel0_Value* params, cel0_SymbolBindingStack* stack) {
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);    
-  if(params_metadata->size != 3) return createPanicValue("ill-formed");
-
-  cel0_Value* condition_expression = eval(params_metadata->vector, stack);
-  if (condition_expression->type == cel0_ValueType_Panic) return condition_expression;
-  if (condition_expression->type != cel0_ValueType_Symbol) return createPanicValue("condition-non-symbol");
-  
-  int true_id = internSymbol("true");
-  int false_id = internSymbol("false");  
-  int symbol_id = condition_expression->u.symbol_id;
-  char condition_true = symbol_id == true_id;
-  char condition_false = !condition_true && (symbol_id == false_id);
-  assert(condition_true || condition_false);
-  assert(condition_true != condition_false);  
-
-  if (condition_true)
-    return eval(params_metadata->vector + 1, stack);
-  return eval(params_metadata->vector + 2, stack);
+  return lambdaCaptureLexicalBindings(params, stack);
 }
 
-static cel0_Value* add(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+/* Numbers wrap around on overflow, so add and mul accumulate unsigned. */
+static cel0_Value add(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);    
-  int result = 0;
-  for (int i=0; i<params_metadata->size; i++) {
-    if (params_metadata->vector[i].type != cel0_ValueType_Number)
-      return createPanicValueWithParam("add-no-number", params_metadata->vector + i);
-    result += params_metadata->vector[i].u.number;
+  unsigned result = 0;
+  for (int i=0; i<argument_count; i++) {
+    if (arguments[i].type != cel0_ValueType_Number)
+      return *createPanicValueWithParam("add-no-number", arguments + i);
+    result += (unsigned)arguments[i].u.number;
   }
-  return createNumberValue(result);
+  return numberValue(result);
 }
 
-static cel0_Value* mul(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value mul(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);    
-  int result = 1;
-  for (int i=0; i<params_metadata->size; i++) {
-    if (params_metadata->vector[i].type != cel0_ValueType_Number)
-      return createPanicValue("param-type");
-    result *= params_metadata->vector[i].u.number;
+  unsigned result = 1;
+  for (int i=0; i<argument_count; i++) {
+    if (arguments[i].type != cel0_ValueType_Number)
+      return *createPanicValue("param-type");
+    result *= (unsigned)arguments[i].u.number;
   }
-  return createNumberValue(result);
+  return numberValue(result);
 }
 
-static cel0_Value* eq(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value eq(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);      
-  if (params_metadata->size != 2) return createPanicValue("eq-ill-formed");
-  if (params_metadata->vector[0].type != params_metadata->vector[1].type) return createPanicValue("eq-!=-types");
+  if (argument_count != 2) return *createPanicValue("eq-ill-formed");
+  if (arguments[0].type != arguments[1].type) return *createPanicValue("eq-!=-types");
 
   char equal = 0;
-  int type = params_metadata->vector[0].type;
+  int type = arguments[0].type;
   if (type == cel0_ValueType_Number) {
-    equal = params_metadata->vector[0].u.number == params_metadata->vector[1].u.number;
+    equal = arguments[0].u.number == arguments[1].u.number;
   } else if (type == cel0_ValueType_Symbol) {
-    equal = params_metadata->vector[0].u.symbol_id == params_metadata->vector[1].u.symbol_id;
+    equal = arguments[0].u.symbol_id == arguments[1].u.symbol_id;
   } else {
     assert(type == cel0_ValueType_Vector);
-    equal = params_metadata->vector[0].u.vector_id == params_metadata->vector[1].u.vector_id;
+    equal = arguments[0].u.vector_id == arguments[1].u.vector_id;
   }
-  return createSymbolValue(equal ? "true" : "false");
+  return symbolValue(equal ? cel0_Symbol_True : cel0_Symbol_False);
 }
 
-static cel0_Value* append(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value append(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);  
-  if (params_metadata->size != 2) return createPanicValue("ill-formed");
-  cel0_Value* vec = params_metadata->vector;
-  if (vec->type != cel0_ValueType_Vector) return createPanicValue("param-type-1");
-  cel0_VectorMetadata* vec_metadata = lookupVectorMetadata(vec->u.vector_id);   
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  cel0_Value* vec = arguments;
+  if (vec->type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");
+  cel0_VectorMetadata* vec_metadata = peekVectorMetadata(vec->u.vector_id);
+  lockContext();
+  unsigned char* bytes = vec_metadata->bytes;
+  cel0_VectorBuffer* buffer = vec_metadata->buffer;
+  int offset = vectorOffset(vec_metadata);
+  if (!bytes && buffer->used == offset + vec_metadata->size && buffer->used < buffer->capacity) {
+    buffer->values[buffer->used++] = arguments[1];
+    cel0_Value* result = createVectorValueSharing(buffer, offset, vec_metadata->size + 1);
+    unlockContext();
+    return *result;
+  }
+  unlockContext();
+  /* Copy with room to spare, so appending to the result shares again. */
   cel0_Value* result = createVectorValue();
-  cel0_VectorMetadata* result_metadata = lookupVectorMetadata(result->u.vector_id);    
+  cel0_VectorMetadata* result_metadata = lookupVectorMetadata(result->u.vector_id);
+  reserveVectorCapacity(result_metadata, 2 * (vec_metadata->size + 1));
+  if (bytes) {
+    for (int i=0; i<vec_metadata->size; i++)
+      result_metadata->vector[i] = numberValue(bytes[i]);
+  } else if (vec_metadata->size) {
+    memcpy(result_metadata->vector, vec_metadata->vector, vec_metadata->size * sizeof(cel0_Value));
+  }
+  result_metadata->vector[vec_metadata->size] = arguments[1];
   result_metadata->size = vec_metadata->size + 1;
-  result_metadata->vector =
-    malloc(result_metadata->size * sizeof(cel0_Value));
-  memcpy(result_metadata->vector, vec_metadata->vector, vec_metadata->size * sizeof(cel0_Value));
-  result_metadata->vector[result_metadata->size - 1] = params_metadata->vector[1];
-  return result;
+  claimVectorBuffer(result_metadata);
+  return *result;
 }
 
-static cel0_Value* length(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value length(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
-  if (params_metadata->size != 1) return createPanicValue("ill-formed");
-  if (params_metadata->vector->type != cel0_ValueType_Vector) return createPanicValue("param-type-1");  
-  return createNumberValue(lookupVectorMetadata(params_metadata->vector->u.vector_id)->size);
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  if (arguments->type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");  
+  return numberValue(peekVectorMetadata(arguments->u.vector_id)->size);
 }
 
-static cel0_Value* nth(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value nth(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
-  if (params_metadata->size != 2) return createPanicValue("ill-formed");
-  cel0_Value* index = params_metadata->vector;
-  if (index->type != cel0_ValueType_Number) return createPanicValue("param-type-1");
-  cel0_Value* vec = params_metadata->vector + 1;
-  if (vec->type != cel0_ValueType_Vector) return createPanicValue("param-type-2");  
-  cel0_VectorMetadata* vec_metadata = lookupVectorMetadata(vec->u.vector_id);
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  cel0_Value* index = arguments;
+  if (index->type != cel0_ValueType_Number) return *createPanicValue("param-type-1");
+  cel0_Value* vec = arguments + 1;
+  if (vec->type != cel0_ValueType_Vector) return *createPanicValue("param-type-2");  
+  cel0_VectorMetadata* vec_metadata = peekVectorMetadata(vec->u.vector_id);
 
   if (index->u.number < 0 || index->u.number >= vec_metadata->size)
-    return createPanicValue("out-of-bounds");
-  return vec_metadata->vector + index->u.number;  
+    return *createPanicValue("out-of-bounds");
+  unsigned char* bytes = vec_metadata->bytes;
+  if (bytes) return numberValue(bytes[index->u.number]);
+  return vec_metadata->vector[index->u.number];  
 }
 
-static cel0_Value* open_file(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value open_file(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
-  if (params_metadata->size != 1) return createPanicValue("ill-formed");
-  cel0_Value* file_name = params_metadata->vector;
-  if (file_name->type != cel0_ValueType_Symbol) return createPanicValue("param-type-1");
-  FILE* file = fopen(lookupSymbolName(file_name->u.symbol_id), "rb");
-  if (!file) return createPanicValue("failed-open");  
-  fseek(file, 0, SEEK_END);
-  int size = ftell(file);
-  rewind(file);
-
-  cel0_Value* buffer = createVectorValue();  
-  cel0_VectorMetadata* buffer_metadata = lookupVectorMetadata(buffer->u.vector_id);
-  buffer_metadata->size = size;
-  buffer_metadata->vector = realloc(buffer_metadata->vector, size * sizeof(cel0_Value));
-
-  for (int i=0; i<size; i++) {
-    buffer_metadata->vector[i].type = cel0_ValueType_Number;
-    buffer_metadata->vector[i].u.number = 0;
-    fread(&buffer_metadata->vector[i].u.number, 1, 1, file);
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  cel0_Value* file_name = arguments;
+  if (file_name->type != cel0_ValueType_Symbol) return *createPanicValue("param-type-1");
+  int file = open(lookupSymbolName(file_name->u.symbol_id), O_RDONLY);
+  if (file < 0) return *createPanicValue("failed-open");
+  struct stat file_stat;
+  if (fstat(file, &file_stat) != 0 || !S_ISREG(file_stat.st_mode)) {
+    close(file);
+    return *createPanicValue("failed-open");
   }
-  fclose(file);
-  return buffer;
+  int size = file_stat.st_size;
+  if (size == 0) {
+    close(file);
+    return *createVectorValue();
+  }
+  unsigned char* bytes = mmap(0, size, PROT_READ, MAP_PRIVATE, file, 0);
+  close(file);
+  if (bytes == MAP_FAILED) return *createPanicValue("failed-open");
+
+  cel0_Value* buffer = allocateValue();
+  buffer->type = cel0_ValueType_Vector;
+  buffer->u.vector_id = createVectorMetadata(cel0_ValueType_Vector);
+  cel0_VectorMetadata* buffer_metadata = peekVectorMetadata(buffer->u.vector_id);
+  releaseVectorBuffer(buffer_metadata);
+  buffer_metadata->bytes = bytes;
+  buffer_metadata->mapping = bytes;
+  buffer_metadata->size = size;
+  lockContext();
+  countBytes(&g_context->memory.mapped_bytes, &g_context->memory.peak_mapped_bytes, size);
+  unlockContext();
+  return *buffer;
 }
 
-static cel0_Value* vector(cel0_Value* params, cel0_SymbolBindingStack* stack) {
+static cel0_Value vector(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
   assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  return params;
+  cel0_Value* result = createVectorValueWithSize(cel0_ValueType_Vector, argument_count);
+  memcpy(lookupVectorMetadata(result->u.vector_id)->vector, arguments, argument_count * sizeof(cel0_Value));
+  return *result;
 }
 
-static cel0_Value* debug_print(cel0_Value* params, cel0_SymbolBindingStack* stack) {
-  assert(stack);
-  assert(params);
-  assert(params->type == cel0_ValueType_Vector);
-  cel0_VectorMetadata* metadata = lookupVectorMetadata(params->u.vector_id);
-  if (metadata->size != 1) return createPanicValue("ill-formed");
-  cel0_printValue(metadata->vector, stdout);
+/* Bulk natives over the elements of a vector. Their kernels have an AVX2
+   version, used when the processor has it, that reads values as pairs of
+   32-bit type and number lanes, or the bytes of a mapped file directly,
+   and a plain loop for everything else. Arithmetic wraps, as add does. */
+#ifdef cel0_Simd
+#define cel0_Avx2 __attribute__((target("avx2")))
+
+static char hasAvx2() {
+  return !!__builtin_cpu_supports("avx2");
+}
+#endif
+
+/* Kernels over values or together the types they read into types, which
+   stay 0 only if all of them are numbers. */
+static unsigned sumNumbersScalar(const cel0_Value* values, int size, int* types) {
+  unsigned sum = 0;
+  for (int i=0; i<size; i++) {
+    *types |= values[i].type;
+    sum += (unsigned)values[i].u.number;
+  }
+  return sum;
+}
+
+static int extremeNumberScalar(const cel0_Value* values, int size, char max, int extreme, int* types) {
+  for (int i=0; i<size; i++) {
+    *types |= values[i].type;
+    if (max ? values[i].u.number > extreme : values[i].u.number < extreme) extreme = values[i].u.number;
+  }
+  return extreme;
+}
+
+static void combineNumbersScalar(const cel0_Value* a, const cel0_Value* b, cel0_Value* out, int size, char multiply, int* types) {
+  for (int i=0; i<size; i++) {
+    *types |= a[i].type | b[i].type;
+    unsigned x = a[i].u.number, y = b[i].u.number;
+    out[i] = numberValue(multiply ? x * y : x + y);
+  }
+}
+
+static int findValueScalar(const cel0_Value* values, int size, cel0_Value value) {
+  for (int i=0; i<size; i++)
+    if (values[i].type == value.type && values[i].u.number == value.u.number) return i;
+  return -1;
+}
+
+static int countEqualValuesScalar(const cel0_Value* values, int size, cel0_Value value) {
+  int count = 0;
+  for (int i=0; i<size; i++)
+    count += values[i].type == value.type && values[i].u.number == value.u.number;
+  return count;
+}
+
+static unsigned sumBytesScalar(const unsigned char* bytes, int size) {
+  unsigned sum = 0;
+  for (int i=0; i<size; i++)
+    sum += bytes[i];
+  return sum;
+}
+
+static int extremeByteScalar(const unsigned char* bytes, int size, char max, int extreme) {
+  for (int i=0; i<size; i++)
+    if (max ? bytes[i] > extreme : bytes[i] < extreme) extreme = bytes[i];
+  return extreme;
+}
+
+static int findByteScalar(const unsigned char* bytes, int size, unsigned char byte) {
+  const unsigned char* found = memchr(bytes, byte, size);
+  return found ? found - bytes : -1;
+}
+
+static int countEqualBytesScalar(const unsigned char* bytes, int size, unsigned char byte) {
+  int count = 0;
+  for (int i=0; i<size; i++)
+    count += bytes[i] == byte;
+  return count;
+}
+
+#ifdef cel0_Simd
+/* Each 256-bit load holds four values; even lanes are types, odd ones
+   numbers. */
+cel0_Avx2 static unsigned sumNumbersAvx2(const cel0_Value* values, int size, int* types) {
+  __m256i sums = _mm256_setzero_si256(), ors = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i loaded = _mm256_loadu_si256((const __m256i*)(values + i));
+    sums = _mm256_add_epi32(sums, loaded);
+    ors = _mm256_or_si256(ors, loaded);
+  }
+  int sum_lanes[8], or_lanes[8];
+  _mm256_storeu_si256((__m256i*)sum_lanes, sums);
+  _mm256_storeu_si256((__m256i*)or_lanes, ors);
+  unsigned sum = 0;
+  for (int lane=0; lane<8; lane+=2) {
+    *types |= or_lanes[lane];
+    sum += (unsigned)sum_lanes[lane + 1];
+  }
+  return sum + sumNumbersScalar(values + i, size - i, types);
+}
+
+cel0_Avx2 static int extremeNumberAvx2(const cel0_Value* values, int size, char max, int extreme, int* types) {
+  __m256i extremes = _mm256_set1_epi32(extreme), ors = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i loaded = _mm256_loadu_si256((const __m256i*)(values + i));
+    extremes = max ? _mm256_max_epi32(extremes, loaded) : _mm256_min_epi32(extremes, loaded);
+    ors = _mm256_or_si256(ors, loaded);
+  }
+  int extreme_lanes[8], or_lanes[8];
+  _mm256_storeu_si256((__m256i*)extreme_lanes, extremes);
+  _mm256_storeu_si256((__m256i*)or_lanes, ors);
+  for (int lane=0; lane<8; lane+=2) {
+    *types |= or_lanes[lane];
+    int number = extreme_lanes[lane + 1];
+    if (max ? number > extreme : number < extreme) extreme = number;
+  }
+  return extremeNumberScalar(values + i, size - i, max, extreme, types);
+}
+
+/* The types of the results are the sums or products of the types of the
+   operands, so 0 wherever both are numbers. */
+cel0_Avx2 static void combineNumbersAvx2(const cel0_Value* a, const cel0_Value* b, cel0_Value* out, int size, char multiply, int* types) {
+  __m256i ors = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i x = _mm256_loadu_si256((const __m256i*)(a + i));
+    __m256i y = _mm256_loadu_si256((const __m256i*)(b + i));
+    _mm256_storeu_si256((__m256i*)(out + i), multiply ? _mm256_mullo_epi32(x, y) : _mm256_add_epi32(x, y));
+    ors = _mm256_or_si256(ors, _mm256_or_si256(x, y));
+  }
+  int or_lanes[8];
+  _mm256_storeu_si256((__m256i*)or_lanes, ors);
+  for (int lane=0; lane<8; lane+=2)
+    *types |= or_lanes[lane];
+  combineNumbersScalar(a + i, b + i, out + i, size - i, multiply, types);
+}
+
+/* Values are equal when all 64 bits of them are. */
+cel0_Avx2 static int findValueAvx2(const cel0_Value* values, int size, cel0_Value value) {
+  long long bits;
+  memcpy(&bits, &value, sizeof(bits));
+  __m256i needle = _mm256_set1_epi64x(bits);
+  int i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(values + i)), needle);
+    int mask = _mm256_movemask_pd(_mm256_castsi256_pd(equal));
+    if (mask) return i + __builtin_ctz(mask);
+  }
+  int found = findValueScalar(values + i, size - i, value);
+  return found < 0 ? -1 : i + found;
+}
+
+cel0_Avx2 static int countEqualValuesAvx2(const cel0_Value* values, int size, cel0_Value value) {
+  long long bits;
+  memcpy(&bits, &value, sizeof(bits));
+  __m256i needle = _mm256_set1_epi64x(bits);
+  int count = 0, i = 0;
+  for (; i + 4 <= size; i += 4) {
+    __m256i equal = _mm256_cmpeq_epi64(_mm256_loadu_si256((const __m256i*)(values + i)), needle);
+    count += __builtin_popcount(_mm256_movemask_pd(_mm256_castsi256_pd(equal)));
+  }
+  return count + countEqualValuesScalar(values + i, size - i, value);
+}
+
+cel0_Avx2 static unsigned sumBytesAvx2(const unsigned char* bytes, int size) {
+  __m256i sums = _mm256_setzero_si256();
+  int i = 0;
+  for (; i + 32 <= size; i += 32)
+    sums = _mm256_add_epi64(sums, _mm256_sad_epu8(_mm256_loadu_si256((const __m256i*)(bytes + i)), _mm256_setzero_si256()));
+  long long sum_lanes[4];
+  _mm256_storeu_si256((__m256i*)sum_lanes, sums);
+  unsigned sum = sum_lanes[0] + sum_lanes[1] + sum_lanes[2] + sum_lanes[3];
+  return sum + sumBytesScalar(bytes + i, size - i);
+}
+
+cel0_Avx2 static int extremeByteAvx2(const unsigned char* bytes, int size, char max, int extreme) {
+  __m256i extremes = _mm256_set1_epi8((char)extreme);
+  int i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i loaded = _mm256_loadu_si256((const __m256i*)(bytes + i));
+    extremes = max ? _mm256_max_epu8(extremes, loaded) : _mm256_min_epu8(extremes, loaded);
+  }
+  unsigned char extreme_lanes[32];
+  _mm256_storeu_si256((__m256i*)extreme_lanes, extremes);
+  return extremeByteScalar(bytes + i, size - i, max, extremeByteScalar(extreme_lanes, 32, max, extreme));
+}
+
+cel0_Avx2 static int countEqualBytesAvx2(const unsigned char* bytes, int size, unsigned char byte) {
+  __m256i needle = _mm256_set1_epi8((char)byte);
+  int count = 0, i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i equal = _mm256_cmpeq_epi8(_mm256_loadu_si256((const __m256i*)(bytes + i)), needle);
+    count += __builtin_popcount((unsigned)_mm256_movemask_epi8(equal));
+  }
+  return count + countEqualBytesScalar(bytes + i, size - i, byte);
+}
+#endif
+
+static unsigned sumNumbers(const cel0_Value* values, int size, int* types) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return sumNumbersAvx2(values, size, types);
+#endif
+  return sumNumbersScalar(values, size, types);
+}
+
+static int extremeNumber(const cel0_Value* values, int size, char max, int* types) {
+  int extreme = max ? INT_MIN : INT_MAX;
+#ifdef cel0_Simd
+  if (hasAvx2()) return extremeNumberAvx2(values, size, max, extreme, types);
+#endif
+  return extremeNumberScalar(values, size, max, extreme, types);
+}
+
+static void combineNumbers(const cel0_Value* a, const cel0_Value* b, cel0_Value* out, int size, char multiply, int* types) {
+#ifdef cel0_Simd
+  if (hasAvx2()) {
+    combineNumbersAvx2(a, b, out, size, multiply, types);
+    return;
+  }
+#endif
+  combineNumbersScalar(a, b, out, size, multiply, types);
+}
+
+static int findValue(const cel0_Value* values, int size, cel0_Value value) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return findValueAvx2(values, size, value);
+#endif
+  return findValueScalar(values, size, value);
+}
+
+static int countEqualValues(const cel0_Value* values, int size, cel0_Value value) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return countEqualValuesAvx2(values, size, value);
+#endif
+  return countEqualValuesScalar(values, size, value);
+}
+
+static unsigned sumBytes(const unsigned char* bytes, int size) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return sumBytesAvx2(bytes, size);
+#endif
+  return sumBytesScalar(bytes, size);
+}
+
+static int extremeByte(const unsigned char* bytes, int size, char max) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return extremeByteAvx2(bytes, size, max, max ? 0 : 255);
+#endif
+  return extremeByteScalar(bytes, size, max, max ? 0 : 255);
+}
+
+static int countEqualBytes(const unsigned char* bytes, int size, unsigned char byte) {
+#ifdef cel0_Simd
+  if (hasAvx2()) return countEqualBytesAvx2(bytes, size, byte);
+#endif
+  return countEqualBytesScalar(bytes, size, byte);
+}
+
+/* The panic for the first element of values, or of others when given,
+   that is not a number. */
+static cel0_Value noNumberPanic(cel0_Value* values, cel0_Value* others) {
+  for (int i=0;; i++) {
+    if (values[i].type != cel0_ValueType_Number) return *createPanicValueWithParam("no-number", values + i);
+    if (others && others[i].type != cel0_ValueType_Number) return *createPanicValueWithParam("no-number", others + i);
+  }
+}
+
+static cel0_Value vector_sum(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  if (arguments->type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");
+  cel0_VectorMetadata* metadata = peekVectorMetadata(arguments->u.vector_id);
+  unsigned char* bytes = metadata->bytes;
+  if (bytes) return numberValue(sumBytes(bytes, metadata->size));
+  int types = 0;
+  unsigned sum = sumNumbers(metadata->vector, metadata->size, &types);
+  return types ? noNumberPanic(metadata->vector, 0) : numberValue(sum);
+}
+
+static cel0_Value vectorExtreme(cel0_Value* arguments, int argument_count, char max) {
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  if (arguments->type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");
+  cel0_VectorMetadata* metadata = peekVectorMetadata(arguments->u.vector_id);
+  if (!metadata->size) return *createPanicValue("empty-vec");
+  unsigned char* bytes = metadata->bytes;
+  if (bytes) return numberValue(extremeByte(bytes, metadata->size, max));
+  int types = 0;
+  int extreme = extremeNumber(metadata->vector, metadata->size, max, &types);
+  return types ? noNumberPanic(metadata->vector, 0) : numberValue(extreme);
+}
+
+static cel0_Value vector_min(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorExtreme(arguments, argument_count, 0);
+}
+
+static cel0_Value vector_max(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorExtreme(arguments, argument_count, 1);
+}
+
+/* (index-of value vector) is the index of the first element eq to value,
+   or -1; (vcount value vector) the number of them. */
+static cel0_Value vectorSearch(cel0_Value* arguments, int argument_count, char count) {
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  if (arguments[1].type != cel0_ValueType_Vector) return *createPanicValue("param-type-2");
+  cel0_Value value = arguments[0];
+  cel0_VectorMetadata* metadata = peekVectorMetadata(arguments[1].u.vector_id);
+  unsigned char* bytes = metadata->bytes;
+  if (bytes) {
+    if (value.type != cel0_ValueType_Number || value.u.number < 0 || value.u.number > 255)
+      return numberValue(count ? 0 : -1);
+    return numberValue(count ? countEqualBytes(bytes, metadata->size, value.u.number) :
+		       findByteScalar(bytes, metadata->size, value.u.number));
+  }
+  return numberValue(count ? countEqualValues(metadata->vector, metadata->size, value) :
+		     findValue(metadata->vector, metadata->size, value));
+}
+
+static cel0_Value index_of(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorSearch(arguments, argument_count, 0);
+}
+
+static cel0_Value vector_count(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorSearch(arguments, argument_count, 1);
+}
+
+static cel0_Value vectorCombine(cel0_Value* arguments, int argument_count, char multiply) {
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  if (arguments[0].type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");
+  if (arguments[1].type != cel0_ValueType_Vector) return *createPanicValue("param-type-2");
+  cel0_VectorMetadata* a = lookupVectorMetadata(arguments[0].u.vector_id);
+  cel0_VectorMetadata* b = lookupVectorMetadata(arguments[1].u.vector_id);
+  if (a->size != b->size) return *createPanicValue("size-mismatch");
+  cel0_Value* result = createVectorValueWithSize(cel0_ValueType_Vector, a->size);
+  int types = 0;
+  combineNumbers(a->vector, b->vector, lookupVectorMetadata(result->u.vector_id)->vector, a->size, multiply, &types);
+  return types ? noNumberPanic(a->vector, b->vector) : *result;
+}
+
+static cel0_Value vector_add(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorCombine(arguments, argument_count, 0);
+}
+
+static cel0_Value vector_mul(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  return vectorCombine(arguments, argument_count, 1);
+}
+
+/* Vectors built whole by a native are at most this long, 512MB of
+   values, so a large argument panics instead of failing to allocate. */
+#define cel0_MaxBuiltVectorLength (1<<26)
+
+/* (range begin end) is the vector of the numbers from begin up to, but
+   not including, end. */
+static cel0_Value range(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  if (arguments[0].type != cel0_ValueType_Number) return *createPanicValue("param-type-1");
+  if (arguments[1].type != cel0_ValueType_Number) return *createPanicValue("param-type-2");
+  int begin = arguments[0].u.number;
+  long long size = (long long)arguments[1].u.number - begin;
+  if (size < 0) size = 0;
+  if (size > cel0_MaxBuiltVectorLength) return *createPanicValue("too-large");
+  cel0_Value* result = createVectorValueWithSize(cel0_ValueType_Vector, size);
+  cel0_Value* values = lookupVectorMetadata(result->u.vector_id)->vector;
+  for (int i=0; i<size; i++)
+    values[i] = numberValue(begin + i);
+  return *result;
+}
+
+/* (slice begin end vector) views the elements of vector from begin up to
+   end without copying them; appending to it copies. Slices of a mapped
+   file copy their bytes instead, as the mapping has no buffer to share. */
+static cel0_Value slice(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  if (argument_count != 3) return *createPanicValue("ill-formed");
+  if (arguments[0].type != cel0_ValueType_Number) return *createPanicValue("param-type-1");
+  if (arguments[1].type != cel0_ValueType_Number) return *createPanicValue("param-type-2");
+  if (arguments[2].type != cel0_ValueType_Vector) return *createPanicValue("param-type-3");
+  int begin = arguments[0].u.number, end = arguments[1].u.number;
+  cel0_VectorMetadata* metadata = peekVectorMetadata(arguments[2].u.vector_id);
+  if (begin < 0 || begin > end || end > metadata->size) return *createPanicValue("out-of-bounds");
+  unsigned char* bytes = metadata->bytes;
+  if (bytes) {
+    cel0_Value* result = createVectorValueWithSize(cel0_ValueType_Vector, end - begin);
+    cel0_Value* values = lookupVectorMetadata(result->u.vector_id)->vector;
+    for (int i=begin; i<end; i++)
+      values[i - begin] = numberValue(bytes[i]);
+    return *result;
+  }
+  return *createVectorValueSharing(metadata->buffer, vectorOffset(metadata) + begin, end - begin);
+}
+
+/* (concat vector ...) is a new vector of the elements of all of them. */
+static cel0_Value concat(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  long long size = 0;
+  for (int i=0; i<argument_count; i++) {
+    if (arguments[i].type != cel0_ValueType_Vector)
+      return *createPanicValueWithParam("concat-no-vector", arguments + i);
+    size += peekVectorMetadata(arguments[i].u.vector_id)->size;
+  }
+  if (size > cel0_MaxBuiltVectorLength) return *createPanicValue("too-large");
+  cel0_Value* result = createVectorValue();
+  cel0_VectorMetadata* result_metadata = lookupVectorMetadata(result->u.vector_id);
+  reserveVectorCapacity(result_metadata, size);
+  for (int i=0; i<argument_count; i++) {
+    /* Mapped files are read in place, as widening them would keep a copy
+       eight times their size for as long as they live. */
+    cel0_VectorMetadata* metadata = peekVectorMetadata(arguments[i].u.vector_id);
+    unsigned char* bytes = metadata->bytes;
+    if (!bytes) {
+      concatVectorsInPlace(result, arguments + i);
+      continue;
+    }
+    for (int j=0; j<metadata->size; j++)
+      result_metadata->vector[result_metadata->size + j] = numberValue(bytes[j]);
+    result_metadata->size += metadata->size;
+    claimVectorBuffer(result_metadata);
+  }
+  return *result;
+}
+
+/* Sorting orders numbers by value and symbols by name. Small ranges are
+   insertion sorted, and ranges that partition badly too many times are
+   heap sorted, which bounds the whole sort to O(n log n). */
+#define cel0_InsertionSortLength 16
+
+static char sortsBefore(cel0_Value a, cel0_Value b) {
+  if (a.type == cel0_ValueType_Number) return a.u.number < b.u.number;
+  return strcmp(g_context->symbol_names[a.u.symbol_id], g_context->symbol_names[b.u.symbol_id]) < 0;
+}
+
+static void insertionSort(cel0_Value* values, int size) {
+  for (int i=1; i<size; i++) {
+    cel0_Value value = values[i];
+    int j = i;
+    for (; j > 0 && sortsBefore(value, values[j - 1]); j--)
+      values[j] = values[j - 1];
+    values[j] = value;
+  }
+}
+
+static void siftDown(cel0_Value* values, int root, int size) {
+  cel0_Value value = values[root];
+  for (int child; (child = 2 * root + 1) < size; root = child) {
+    if (child + 1 < size && sortsBefore(values[child], values[child + 1])) child++;
+    if (!sortsBefore(value, values[child])) break;
+    values[root] = values[child];
+  }
+  values[root] = value;
+}
+
+static void heapSort(cel0_Value* values, int size) {
+  for (int i=size/2-1; i>=0; i--)
+    siftDown(values, i, size);
+  for (int end=size-1; end>0; end--) {
+    cel0_Value top = values[0];
+    values[0] = values[end];
+    values[end] = top;
+    siftDown(values, 0, end);
+  }
+}
+
+static void introSort(cel0_Value* values, int size, int depth) {
+  while (size > cel0_InsertionSortLength) {
+    if (depth-- == 0) {
+      heapSort(values, size);
+      return;
+    }
+    cel0_Value a = values[0], b = values[size / 2], c = values[size - 1];
+    cel0_Value pivot = sortsBefore(a, b) ?
+      (sortsBefore(b, c) ? b : sortsBefore(a, c) ? c : a) :
+      (sortsBefore(a, c) ? a : sortsBefore(b, c) ? c : b);
+    int i = -1, j = size;
+    for (;;) {
+      while (sortsBefore(values[++i], pivot));
+      while (sortsBefore(pivot, values[--j]));
+      if (i >= j) break;
+      cel0_Value swapped = values[i];
+      values[i] = values[j];
+      values[j] = swapped;
+    }
+    if (j + 1 < size - j - 1) {
+      introSort(values, j + 1, depth);
+      values += j + 1;
+      size -= j + 1;
+    } else {
+      introSort(values + j + 1, size - j - 1, depth);
+      size = j + 1;
+    }
+  }
+  insertionSort(values, size);
+}
+
+/* (sort vector) is a sorted copy of a vector of numbers or of symbols.
+   The bytes of a mapped file are counted instead. */
+static cel0_Value sort(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  if (arguments->type != cel0_ValueType_Vector) return *createPanicValue("param-type-1");
+  cel0_VectorMetadata* metadata = peekVectorMetadata(arguments->u.vector_id);
+  int size = metadata->size;
+  cel0_Value* result = createVectorValueWithSize(cel0_ValueType_Vector, size);
+  cel0_Value* values = lookupVectorMetadata(result->u.vector_id)->vector;
+  unsigned char* bytes = metadata->bytes;
+  if (bytes) {
+    int counts[256] = {0};
+    for (int i=0; i<size; i++)
+      counts[bytes[i]]++;
+    for (int byte=0, i=0; byte<256; byte++)
+      for (int count=0; count<counts[byte]; count++)
+	values[i++] = numberValue(byte);
+    return *result;
+  }
+  for (int i=0; i<size; i++) {
+    cel0_Value* element = metadata->vector + i;
+    if (element->type != cel0_ValueType_Number && element->type != cel0_ValueType_Symbol)
+      return *createPanicValueWithParam("sort-no-order", element);
+    if (element->type != metadata->vector[0].type)
+      return *createPanicValueWithParam("sort-!=-types", element);
+  }
+  if (size > 0) memcpy(values, metadata->vector, size * sizeof(cel0_Value));
+  int depth = 0;
+  for (int length=size; length>1; length/=2)
+    depth += 2;
+  /* Symbol names stay put only while no other thread adds symbols. */
+  lockContext();
+  introSort(values, size, depth);
+  unlockContext();
+  return *result;
+}
+
+static cel0_Value* createStatsRow(char* name, long long* numbers, int size) {
+  cel0_Value* row = createVectorValueWithSize(cel0_ValueType_Vector, size + 1);
+  cel0_Value* elements = lookupVectorMetadata(row->u.vector_id)->vector;
+  elements[0] = *createSymbolValue(name);
+  for (int i=0; i<size; i++)
+    elements[i + 1] = numberValue(numbers[i] > INT_MAX ? INT_MAX : numbers[i]);
+  return row;
+}
+
+/* ((number allocated) (symbol allocated interned name-bytes)
+    (vector allocated live peak) (panic allocated live peak)
+    (vector-buffers bytes peak-bytes) (mapped-files bytes peak-bytes)
+    (metadata-slots used live capacity) (scratch-values live peak bytes)),
+   numbers capped at the largest one. */
+static cel0_Value memoryStats() {
+  lockContext();
+  cel0_MemoryStats memory = g_context->memory;
+  int chunks = 0;
+  for (cel0_ValueChunk* chunk = g_context->value_chunks; chunk; chunk = chunk->next)
+    chunks++;
+  int scratch_values = scratchValues();
+  long long rows[][4] = {
+    { memory.allocated[cel0_ValueType_Number] },
+    { memory.allocated[cel0_ValueType_Symbol], g_context->symbol_number, memory.symbol_bytes },
+    { memory.allocated[cel0_ValueType_Vector], memory.live[cel0_ValueType_Vector], memory.peak[cel0_ValueType_Vector] },
+    { memory.allocated[cel0_ValueType_Panic], memory.live[cel0_ValueType_Panic], memory.peak[cel0_ValueType_Panic] },
+    { memory.buffer_bytes, memory.peak_buffer_bytes },
+    { memory.mapped_bytes, memory.peak_mapped_bytes },
+    { g_context->vector_metadata_number, g_context->live_vector_metadata_number, cel0_MaxVectorMetadataLength },
+    { scratch_values, g_context->memory.peak_scratch_values, (long long)chunks * sizeof(cel0_ValueChunk) },
+  };
+  unlockContext();
+  char* names[] = { "number", "symbol", "vector", "panic", "vector-buffers", "mapped-files", "metadata-slots", "scratch-values" };
+  int sizes[] = { 1, 3, 3, 3, 2, 2, 3, 3 };
+  int rows_size = sizeof(sizes) / sizeof(sizes[0]);
+  cel0_Value* stats = createVectorValueWithSize(cel0_ValueType_Vector, rows_size);
+  for (int i=0; i<rows_size; i++) {
+    cel0_Value row = *createStatsRow(names[i], rows[i], sizes[i]);
+    lookupVectorMetadata(stats->u.vector_id)->vector[i] = row;
+  }
+  return *stats;
+}
+
+static cel0_Value mem_stats(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  (void)arguments;
+  if (argument_count != 0) return *createPanicValue("ill-formed");
+  return memoryStats();
+}
+
+static cel0_Value debug_print(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  assert(stack);
+  if (argument_count != 1) return *createPanicValue("ill-formed");
+  printValue(arguments, stdout);
   printf("\n");
-  return metadata->vector;
+  return arguments[0];
+}
+
+
+/* Bytecode. Every lambda body and every program is compiled once into a
+   flat instruction array run by a register machine. Instructions are an
+   opcode followed by its operands; register operands are relative to the
+   base of the current frame. */
+#define cel0_OpCode_LoadConstant 0   /* target constant */
+#define cel0_OpCode_Move 1           /* target source */
+#define cel0_OpCode_LoadNativeName 2 /* target global */
+#define cel0_OpCode_CallNative 3     /* target global argument_base argument_count */
+#define cel0_OpCode_Call 4           /* target callee argument_base argument_count head */
+#define cel0_OpCode_Test 5           /* condition else_pc */
+#define cel0_OpCode_Jump 6           /* pc */
+#define cel0_OpCode_MakeClosure 7    /* target function */
+#define cel0_OpCode_Panic 8          /* constant */
+#define cel0_OpCode_Return 9         /* source */
+#define cel0_OpCode_TailCall 10      /* target callee argument_base argument_count head */
+#define cel0_OpCode_ParallelCall 11  /* base count */
+#define cel0_OpCode_TestParallel 12  /* else_pc */
+
+/* Forms whose panics get the form itself appended to the trace, the way
+   eval appended the transform call to panics returned by a transform. */
+typedef struct cel0_TraceRegion {
+  int begin;
+  int end;
+  cel0_Value form;
+} cel0_TraceRegion;
+
+struct cel0_Function;
+typedef struct cel0_Code {
+  int* instructions;
+  int instructions_size;
+  int instructions_capacity;
+  cel0_Value* constants;
+  int constants_size;
+  int constants_capacity;
+  struct cel0_Function** functions;
+  int functions_size;
+  int functions_capacity;
+  cel0_TraceRegion* regions;
+  int regions_size;
+  int regions_capacity;
+  int register_count;
+  /* The same instructions compiled to C by --emit-c, or 0. */
+  cel0_CompiledCode compiled;
+} cel0_Code;
+
+/* A compiled lambda. Its frame holds the lambda list (parameters followed
+   by captured bindings), then the closure itself for #self-rec, then the
+   locals of the body. */
+typedef struct cel0_Function {
+  int parameter_count;
+  int lambda_list_size;
+  cel0_Value lambda_list;
+  cel0_Value body;
+  cel0_Value* capture_symbols;
+  int* capture_registers;
+  int capture_count;
+  cel0_Code* code;
+  /* Bound on the results cached by each closure, 0 unless memo-lambda. */
+  int memo_capacity;
+} cel0_Function;
+
+typedef struct cel0_Compiler {
+  cel0_Code* code;
+  cel0_SymbolBindingStack* stack;
+  int next_register;
+  /* Only expressions in tail position are compiled into the register a
+     function returns, so calls targeting it reuse the frame. */
+  int tail_register;
+} cel0_Compiler;
+
+static void* growBuffer(void* buffer, int* capacity, int needed, size_t element_size) {
+  if (needed <= *capacity) return buffer;
+  int new_capacity = *capacity ? *capacity : 16;
+  while (new_capacity < needed) new_capacity *= 2;
+  buffer = realloc(buffer, new_capacity * element_size);
+  assert(buffer);
+  *capacity = new_capacity;
+  return buffer;
+}
+
+
+static cel0_Code* createCode() {
+  cel0_Code* code = calloc(1, sizeof(cel0_Code));
+  assert(code);
+  g_context->codes = growBuffer(g_context->codes, &g_context->codes_capacity, g_context->codes_size + 1, sizeof(cel0_Code*));
+  g_context->codes[g_context->codes_size++] = code;
+  return code;
+}
+
+/* Frees the code compiled since g_context->codes held codes_size entries. Closures
+   cache functions from it, so every cached function is dropped too. */
+static void releaseCodes(int codes_size) {
+  for (int i=codes_size; i<g_context->codes_size; i++) {
+    cel0_Code* code = g_context->codes[i];
+    for (int j=0; j<code->functions_size; j++) {
+      free(code->functions[j]->capture_symbols);
+      free(code->functions[j]->capture_registers);
+      free(code->functions[j]);
+    }
+    free(code->instructions);
+    free(code->constants);
+    free(code->functions);
+    free(code->regions);
+    free(code);
+  }
+  g_context->codes_size = codes_size;
+  for (int i=0; i<g_context->vector_metadata_number; i++)
+    g_context->vector_metadata[i].function = 0;
+}
+
+static int emit(cel0_Code* code, int word) {
+  code->instructions = growBuffer(code->instructions, &code->instructions_capacity,
+				  code->instructions_size + 1, sizeof(int));
+  code->instructions[code->instructions_size] = word;
+  return code->instructions_size++;
+}
+
+static int addConstant(cel0_Code* code, cel0_Value* value) {
+  code->constants = growBuffer(code->constants, &code->constants_capacity,
+			       code->constants_size + 1, sizeof(cel0_Value));
+  code->constants[code->constants_size] = *value;
+  return code->constants_size++;
+}
+
+static int addFunction(cel0_Code* code, cel0_Function* function) {
+  code->functions = growBuffer(code->functions, &code->functions_capacity,
+			       code->functions_size + 1, sizeof(cel0_Function*));
+  code->functions[code->functions_size] = function;
+  return code->functions_size++;
+}
+
+static void addTraceRegion(cel0_Code* code, int begin, cel0_Value* form) {
+  code->regions = growBuffer(code->regions, &code->regions_capacity,
+			     code->regions_size + 1, sizeof(cel0_TraceRegion));
+  code->regions[code->regions_size++] = (cel0_TraceRegion)
+    { .begin = begin, .end = code->instructions_size, .form = *form };
+}
+
+static int allocateRegister(cel0_Compiler* compiler) {
+  int index = compiler->next_register++;
+  if (compiler->next_register > compiler->code->register_count)
+    compiler->code->register_count = compiler->next_register;
+  return index;
+}
+
+/* At compile time local bindings map a symbol to the register holding its
+   value, so the captureLexicalBindings hooks report captures as
+   (symbol register) entries. */
+static cel0_SymbolBinding* pushLocalBinding(cel0_SymbolBindingStack* stack, cel0_Value* symbol, int index) {
+  return pushSymbolBinding(stack, symbol, createNumberValue(index));
+}
+
+static int localBindingRegister(cel0_SymbolBinding* binding) {
+  assert(binding->type == cel0_SymbolBindingType_Expression);
+  assert(binding->u.expression->type == cel0_ValueType_Number);
+  return binding->u.expression->u.number;
+}
+
+static cel0_Value* formParameters(cel0_Value* form) {
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(form->u.vector_id);
+  cel0_Value* params = createVectorValue();
+  for (int i=1; i<metadata->size; i++)
+    params = appendValueToVectorInPlace(params, metadata->vector + i);
+  return params;
+}
+
+static void compilePanic(cel0_Compiler* compiler, cel0_Value* panic) {
+  assert(panic->type == cel0_ValueType_Panic);
+  emit(compiler->code, cel0_OpCode_Panic);
+  emit(compiler->code, addConstant(compiler->code, panic));
+}
+
+static void compileLoadConstant(cel0_Compiler* compiler, cel0_Value* value, int target) {
+  emit(compiler->code, cel0_OpCode_LoadConstant);
+  emit(compiler->code, target);
+  emit(compiler->code, addConstant(compiler->code, value));
+}
+
+static void compileQuote(cel0_Compiler* compiler, cel0_Value* form, int target);
+
+static char isFoldableNative(cel0_Value (*native)(cel0_Value*, int, cel0_SymbolBindingStack*)) {
+  return native == add || native == mul || native == eq || native == length || native == nth || native == vector;
+}
+
+/* The value of expression when it depends only on literals and known
+   bindings and evaluating it does not panic, else 0. Vectors built by a
+   native are only folded as arguments of another, since evaluating the
+   call builds a new one each time. */
+static cel0_Value* foldConstant(cel0_Compiler* compiler, cel0_Value* expression, char argument) {
+  if (expression->type == cel0_ValueType_Number) return expression;
+  if (expression->type == cel0_ValueType_Symbol) {
+    cel0_SymbolBinding* binding = lookupSymbolBinding(expression, compiler->stack);
+    return binding && binding->type == cel0_SymbolBindingType_Expression ? binding->constant : 0;
+  }
+  if (expression->type != cel0_ValueType_Vector) return 0;
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(expression->u.vector_id);
+  if (metadata->size == 0 || metadata->vector->type != cel0_ValueType_Symbol) return 0;
+  cel0_SymbolBinding* binding = lookupSymbolBinding(metadata->vector, compiler->stack);
+  if (!binding) return 0;
+  if (binding->type == cel0_SymbolBindingType_TransformNative)
+    return binding->u.transform.compile == compileQuote && metadata->size == 2 ? metadata->vector + 1 : 0;
+  if (binding->type != cel0_SymbolBindingType_Native || !isFoldableNative(binding->u.native.expression))
+    return 0;
+
+  int argument_count = metadata->size - 1;
+  cel0_Value* arguments = malloc(argument_count * sizeof(cel0_Value) + 1);
+  assert(arguments);
+  for (int i=0; i<argument_count; i++) {
+    cel0_Value* constant = foldConstant(compiler, metadata->vector + i + 1, 1);
+    if (!constant) {
+      free(arguments);
+      return 0;
+    }
+    arguments[i] = *constant;
+  }
+  cel0_Value result = binding->u.native.expression(arguments, argument_count, compiler->stack);
+  free(arguments);
+  if (result.type == cel0_ValueType_Panic || (result.type == cel0_ValueType_Vector && !argument)) return 0;
+  cel0_Value* value = allocateValue();
+  *value = result;
+  return value;
+}
+
+static void compileExpression(cel0_Compiler* compiler, cel0_Value* value, int target) {
+  assert(value);
+  cel0_Code* code = compiler->code;
+  cel0_SymbolBindingStack* stack = compiler->stack;
+
+  if (value->type == cel0_ValueType_Number) {
+    compileLoadConstant(compiler, value, target);
+  } else if (value->type == cel0_ValueType_Symbol) {
+    cel0_SymbolBinding* binding = lookupSymbolBinding(value, stack);
+    if (!binding) {
+      compilePanic(compiler, createPanicValueWithParam("unbound", value));
+      return;
+    }
+    if (binding->type == cel0_SymbolBindingType_Expression && binding->constant) {
+      compileLoadConstant(compiler, binding->constant, target);
+    } else if (binding->type == cel0_SymbolBindingType_Expression) {
+      emit(code, cel0_OpCode_Move);
+      emit(code, target);
+      emit(code, localBindingRegister(binding));
+    } else {
+      emit(code, cel0_OpCode_LoadNativeName);
+      emit(code, target);
+      emit(code, binding - stack->frames);
+    }
+  } else {
+    assert(value->type == cel0_ValueType_Vector);
+    cel0_VectorMetadata* value_metadata = lookupVectorMetadata(value->u.vector_id);
+    if (value_metadata->size == 0) {
+      compilePanic(compiler, createPanicValue("empty-vec"));
+      return;
+    }
+    if (value_metadata->vector->type != cel0_ValueType_Symbol) {
+      compilePanic(compiler, createPanicValue("not-symbol"));
+      return;
+    }
+
+    cel0_SymbolBinding* binding = lookupSymbolBinding(value_metadata->vector, stack);
+    if (!binding) {
+      compilePanic(compiler, createPanicValueWithParam("unbound", value_metadata->vector));
+      return;
+    }
+
+    if (binding->type == cel0_SymbolBindingType_TransformNative) {
+      int begin = code->instructions_size;
+      binding->u.transform.compile(compiler, value, target);
+      addTraceRegion(code, begin, value);
+      return;
+    }
+
+    if (binding->type == cel0_SymbolBindingType_Native) {
+      cel0_Value* constant = foldConstant(compiler, value, 0);
+      if (constant) {
+	compileLoadConstant(compiler, constant, target);
+	return;
+      }
+    }
+
+    int argument_base = compiler->next_register;
+    int argument_count = value_metadata->size - 1;
+    for (int i=0; i<argument_count; i++)
+      compileExpression(compiler, value_metadata->vector + i + 1, allocateRegister(compiler));
+    compiler->next_register = argument_base;
+
+    if (binding->type == cel0_SymbolBindingType_Native) {
+      emit(code, cel0_OpCode_CallNative);
+      emit(code, target);
+      emit(code, binding - stack->frames);
+      emit(code, argument_base);
+      emit(code, argument_count);
+    } else {
+      emit(code, target == compiler->tail_register ? cel0_OpCode_TailCall : cel0_OpCode_Call);
+      emit(code, target);
+      emit(code, localBindingRegister(binding));
+      emit(code, argument_base);
+      emit(code, argument_count);
+      emit(code, addConstant(code, value_metadata->vector));
+    }
+  }
+}
+
+/* constants, if not 0, holds the known value of each lambda list entry or 0. */
+static cel0_Code* compileFunctionBody(cel0_SymbolBindingStack* stack, cel0_Value* lambda_list_symbols,
+				      cel0_Value** constants, int lambda_list_size, cel0_Value* body) {
+  int caller_stack_begin = stack->begin;
+  int caller_stack_size = stack->size;
+  stack->begin = stack->size;
+  cel0_Compiler compiler = { .code = createCode(), .stack = stack, .next_register = 0, .tail_register = -1 };
+  for (int i=0; i<lambda_list_size; i++) {
+    cel0_SymbolBinding* binding = pushLocalBinding(stack, lambda_list_symbols + i, allocateRegister(&compiler));
+    if (constants) binding->constant = constants[i];
+  }
+  pushLocalBinding(stack, placeHolderForRecursion(), allocateRegister(&compiler));
+  int result = allocateRegister(&compiler);
+  compiler.tail_register = result;
+  compileExpression(&compiler, body, result);
+  emit(compiler.code, cel0_OpCode_Return);
+  emit(compiler.code, result);
+  popSymbolBindings(stack, caller_stack_size);
+  stack->begin = caller_stack_begin;
+  return compiler.code;
+}
+
+/* Compiles a vector that is applied without having been built by lambda,
+   e.g. a quoted ((x) body). */
+static cel0_Function* compileClosure(cel0_Value* closure, cel0_SymbolBindingStack* stack) {
+  cel0_VectorMetadata* closure_metadata = lookupVectorMetadata(closure->u.vector_id);
+  cel0_VectorMetadata* lambda_list_metadata = lookupVectorMetadata(closure_metadata->vector->u.vector_id);
+  cel0_Function* function = calloc(1, sizeof(cel0_Function));
+  assert(function);
+  int number_param = 0;
+  for (; number_param<lambda_list_metadata->size &&
+	 lambda_list_metadata->vector[number_param].type == cel0_ValueType_Symbol; number_param++);
+  function->parameter_count = number_param;
+  function->lambda_list_size = lambda_list_metadata->size;
+  function->lambda_list = closure_metadata->vector[0];
+  function->body = closure_metadata->vector[1];
+
+  cel0_Value* symbols = malloc(lambda_list_metadata->size * sizeof(cel0_Value) + 1);
+  assert(symbols);
+  for (int i=0; i<lambda_list_metadata->size; i++) {
+    if (i<number_param) {
+      symbols[i] = lambda_list_metadata->vector[i];
+    } else {
+      assert(lambda_list_metadata->vector[i].type == cel0_ValueType_Vector);
+      cel0_VectorMetadata* param_metadata =
+	lookupVectorMetadata(lambda_list_metadata->vector[i].u.vector_id);
+      assert(param_metadata->size == 2);
+      assert(param_metadata->vector->type == cel0_ValueType_Symbol);
+      symbols[i] = *param_metadata->vector;
+    }
+  }
+  function->code = compileFunctionBody(stack, symbols, 0, lambda_list_metadata->size, &function->body);
+  /* Owned by its own code, which also keeps its lambda list and body alive. */
+  addFunction(function->code, function);
+  free(symbols);
+  return function;
+}
+
+static void compileBind(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  if (form_metadata->size < 3) {
+    compilePanic(compiler, createPanicValueWithParam("ill-formed", formParameters(form)));
+    return;
+  }
+
+  cel0_SymbolBindingStack* stack = compiler->stack;
+  int caller_stack_size = stack->size;
+  int caller_next_register = compiler->next_register;
+  cel0_Value* panic = 0;
+  for (int i=1; i<form_metadata->size-1 && !panic; i++) {
+    if (form_metadata->vector[i].type != cel0_ValueType_Vector) {
+      panic = createPanicValueWithParam("ill-formed", formParameters(form));
+      break;
+    }
+    cel0_VectorMetadata* binding_metadata =
+      lookupVectorMetadata(form_metadata->vector[i].u.vector_id);
+    if (binding_metadata->size != 2 || binding_metadata->vector->type != cel0_ValueType_Symbol) {
+      panic = createPanicValue("ill-formed");
+      break;
+    }
+    int slot = allocateRegister(compiler);
+    cel0_SymbolBinding* binding = pushLocalBinding(stack, binding_metadata->vector, slot);
+    /* A clause known when compiling is not evaluated again, even in a
+       lambda applied many times: references to it load the constant. */
+    binding->constant = foldConstant(compiler, binding_metadata->vector + 1, 0);
+    if (binding->constant) {
+      compileLoadConstant(compiler, binding->constant, slot);
+    } else {
+      compileLoadConstant(compiler, placeHolderForRecursion(), slot);
+      compileExpression(compiler, binding_metadata->vector + 1, slot);
+    }
+  }
+  if (panic)
+    compilePanic(compiler, panic);
+  else
+    compileExpression(compiler, form_metadata->vector + form_metadata->size - 1, target);
+  popSymbolBindings(stack, caller_stack_size);
+  compiler->next_register = caller_next_register;
+}
+
+static void compileIf(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  if (form_metadata->size != 4) {
+    compilePanic(compiler, createPanicValue("ill-formed"));
+    return;
+  }
+
+  cel0_Code* code = compiler->code;
+  int condition = allocateRegister(compiler);
+  compileExpression(compiler, form_metadata->vector + 1, condition);
+  compiler->next_register = condition;
+  emit(code, cel0_OpCode_Test);
+  emit(code, condition);
+  int else_pc = emit(code, 0);
+  compileExpression(compiler, form_metadata->vector + 2, target);
+  emit(code, cel0_OpCode_Jump);
+  int end_pc = emit(code, 0);
+  code->instructions[else_pc] = code->instructions_size;
+  compileExpression(compiler, form_metadata->vector + 3, target);
+  code->instructions[end_pc] = code->instructions_size;
+}
+
+static void compileQuote(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  if (form_metadata->size != 2) {
+    compilePanic(compiler, createPanicValue("quote-ill-formed"));
+    return;
+  }
+  compileLoadConstant(compiler, form_metadata->vector + 1, target);
+}
+
+/* Emits the creation of a closure over params, (lambda_list body), and
+   returns its function, or 0 after emitting a panic. */
+static cel0_Function* compileMakeClosure(cel0_Compiler* compiler, cel0_Value* params, int target) {
+  cel0_VectorMetadata* params_metadata = lookupVectorMetadata(params->u.vector_id);
+  cel0_VectorMetadata* lambda_list_metadata = lookupVectorMetadata(params_metadata->vector[0].u.vector_id);
+  cel0_Value* captures = lambdaCaptureLexicalBindings(params, compiler->stack);
+  if (captures->type == cel0_ValueType_Panic) {
+    compilePanic(compiler, captures);
+    return 0;
+  }
+  cel0_VectorMetadata* captures_metadata = lookupVectorMetadata(captures->u.vector_id);
+
+  cel0_Function* function = calloc(1, sizeof(cel0_Function));
+  assert(function);
+  function->parameter_count = lambda_list_metadata->size;
+  function->lambda_list_size = lambda_list_metadata->size + captures_metadata->size;
+  function->lambda_list = params_metadata->vector[0];
+  function->body = params_metadata->vector[1];
+  function->capture_count = captures_metadata->size;
+  function->capture_symbols = malloc(function->capture_count * sizeof(cel0_Value) + 1);
+  function->capture_registers = malloc(function->capture_count * sizeof(int) + 1);
+  assert(function->capture_symbols && function->capture_registers);
+
+  cel0_Value* symbols = malloc(function->lambda_list_size * sizeof(cel0_Value) + 1);
+  cel0_Value** constants = calloc(function->lambda_list_size + 1, sizeof(cel0_Value*));
+  assert(symbols && constants);
+  memcpy(symbols, lambda_list_metadata->vector, lambda_list_metadata->size * sizeof(cel0_Value));
+  for (int i=0; i<captures_metadata->size; i++) {
+    cel0_VectorMetadata* entry = lookupVectorMetadata(captures_metadata->vector[i].u.vector_id);
+    assert(entry->size == 2 && entry->vector[0].type == cel0_ValueType_Symbol);
+    function->capture_symbols[i] = entry->vector[0];
+    /* Bindings still being evaluated by bind hooks capture #self-rec. */
+    function->capture_registers[i] = entry->vector[1].type == cel0_ValueType_Number ?
+      entry->vector[1].u.number : -1;
+    symbols[lambda_list_metadata->size + i] = entry->vector[0];
+    /* Captured constants are still copied into the closure, which prints
+       the same, but the body loads them directly. */
+    cel0_SymbolBinding* binding = lookupSymbolBinding(entry->vector, compiler->stack);
+    constants[lambda_list_metadata->size + i] = binding ? binding->constant : 0;
+  }
+  function->code = compileFunctionBody(compiler->stack, symbols, constants, function->lambda_list_size, &function->body);
+  free(symbols);
+  free(constants);
+
+  emit(compiler->code, cel0_OpCode_MakeClosure);
+  emit(compiler->code, target);
+  emit(compiler->code, addFunction(compiler->code, function));
+  return function;
+}
+
+/* Compiles (head lambda_list body), returning the function of the closure
+   or 0 after emitting a panic. */
+static cel0_Function* compileLambdaForm(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  if (form_metadata->size != 3 ||
+      form_metadata->vector[1].type != cel0_ValueType_Vector) {
+    compilePanic(compiler, createPanicValue("ill-formed"));
+    return 0;
+  }
+
+  cel0_VectorMetadata* lambda_list_metadata = lookupVectorMetadata(form_metadata->vector[1].u.vector_id);
+  for (int i=0; i<lambda_list_metadata->size; i++) {
+    if (lambda_list_metadata->vector[i].type != cel0_ValueType_Symbol) {
+      compilePanic(compiler, createPanicValueWithParam("lambda-list-ill-formed", lambda_list_metadata->vector + i));
+      return 0;
+    }
+  }
+  return compileMakeClosure(compiler, formParameters(form), target);
+}
+
+static void compileLambda(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  compileLambdaForm(compiler, form, target);
+}
+
+#define cel0_DefaultMemoCapacity 1024
+
+/* (memo-lambda [capacity] lambda_list body) builds a closure that caches
+   up to capacity results, keyed by the structure of its arguments. */
+static void compileMemoLambda(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  int capacity = cel0_DefaultMemoCapacity;
+  if (form_metadata->size == 4 && form_metadata->vector[1].type == cel0_ValueType_Number) {
+    capacity = form_metadata->vector[1].u.number;
+    if (capacity < 1) {
+      compilePanic(compiler, createPanicValueWithParam("memo-capacity", form_metadata->vector + 1));
+      return;
+    }
+    cel0_Value* lambda_form = appendValueToVectorInPlace(createVectorValue(), form_metadata->vector);
+    lambda_form = appendValueToVectorInPlace(lambda_form, form_metadata->vector + 2);
+    form = appendValueToVectorInPlace(lambda_form, form_metadata->vector + 3);
+  }
+  cel0_Function* function = compileLambdaForm(compiler, form, target);
+  if (function) function->memo_capacity = capacity;
+}
+
+/* Whether expression calls none of the natives with effects beyond their
+   result, anywhere in it, lambda bodies included. Closures it calls by
+   name are taken to have none. */
+static char callsNoEffectfulNative(cel0_Compiler* compiler, cel0_Value* expression) {
+  if (expression->type != cel0_ValueType_Vector) return 1;
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(expression->u.vector_id);
+  if (metadata->size && metadata->vector->type == cel0_ValueType_Symbol) {
+    cel0_SymbolBinding* binding = lookupSymbolBinding(metadata->vector, compiler->stack);
+    if (binding && binding->type == cel0_SymbolBindingType_TransformNative && binding->u.transform.compile == compileQuote)
+      return 1;
+    if (binding && binding->type == cel0_SymbolBindingType_Native &&
+	(binding->u.native.expression == debug_print || binding->u.native.expression == open_file ||
+	 binding->u.native.expression == mem_stats))
+      return 0;
+  }
+  for (int i=0; i<metadata->size; i++)
+    if (!callsNoEffectfulNative(compiler, metadata->vector + i)) return 0;
+  return 1;
+}
+
+/* pbind binds like bind, but evaluates clauses that do not refer to one
+   another concurrently. In order, each clause joins the current wave
+   unless it refers to a clause of it, and then starts the next one. A
+   clause with effects gets a wave of its own, so it runs only after the
+   clauses before it did not panic and before any after it, as in bind.
+   Returns the wave of each clause in waves. */
+static void parallelBindWaves(cel0_Compiler* compiler, cel0_VectorMetadata* form_metadata, int* waves) {
+  cel0_SymbolBindingStack* stack = compiler->stack;
+  int caller_stack_size = stack->size;
+  int wave = 0;
+  int wave_begin = 0;
+  char previous_effectless = 1;
+  for (int i=0; i<form_metadata->size-2; i++) {
+    cel0_Value* clause = lookupVectorMetadata(form_metadata->vector[i + 1].u.vector_id)->vector;
+    pushSymbolBinding(stack, clause, placeHolderForRecursion());
+    cel0_Value* captures = captureLexicalBindings(clause + 1, stack);
+    char dependent = captures->type == cel0_ValueType_Panic;
+    if (!dependent) {
+      cel0_VectorMetadata* captures_metadata = lookupVectorMetadata(captures->u.vector_id);
+      for (int j=0; j<captures_metadata->size && !dependent; j++) {
+	cel0_Value* symbol = lookupVectorMetadata(captures_metadata->vector[j].u.vector_id)->vector;
+	int captured_clause = lookupSymbolBinding(symbol, stack) - stack->frames - caller_stack_size;
+	dependent = captured_clause >= wave_begin && captured_clause < i;
+      }
+    }
+    char effectless = callsNoEffectfulNative(compiler, clause + 1);
+    if ((dependent || !effectless || !previous_effectless) && i > wave_begin) {
+      wave++;
+      wave_begin = i;
+    }
+    previous_effectless = effectless;
+    waves[i] = wave;
+  }
+  popSymbolBindings(stack, caller_stack_size);
+}
+
+/* The clauses of a wave of several are compiled into closures without
+   parameters and applied by ParallelCall, whose results and first panic
+   are those of evaluating them in order. Where the pool cannot run them
+   concurrently, TestParallel branches to the clauses compiled as bind
+   would. */
+static void compileParallelBind(cel0_Compiler* compiler, cel0_Value* form, int target) {
+  cel0_VectorMetadata* form_metadata = lookupVectorMetadata(form->u.vector_id);
+  char well_formed = form_metadata->size >= 3;
+  for (int i=1; i<form_metadata->size-1 && well_formed; i++) {
+    if (form_metadata->vector[i].type != cel0_ValueType_Vector) {
+      well_formed = 0;
+    } else {
+      cel0_VectorMetadata* binding_metadata = lookupVectorMetadata(form_metadata->vector[i].u.vector_id);
+      well_formed = binding_metadata->size == 2 && binding_metadata->vector->type == cel0_ValueType_Symbol;
+    }
+  }
+  /* Panics where bind would. */
+  if (!well_formed) {
+    compileBind(compiler, form, target);
+    return;
+  }
+
+  int clause_count = form_metadata->size - 2;
+  int* waves = malloc(clause_count * sizeof(int));
+  assert(waves);
+  parallelBindWaves(compiler, form_metadata, waves);
+
+  cel0_SymbolBindingStack* stack = compiler->stack;
+  int caller_stack_size = stack->size;
+  int caller_next_register = compiler->next_register;
+  for (int begin=0, end; begin<clause_count; begin=end) {
+    for (end=begin+1; end<clause_count && waves[end] == waves[begin]; end++);
+    int base = compiler->next_register;
+    int wave_stack_size = stack->size;
+    int end_pc = -1;
+    if (end - begin > 1) {
+      cel0_Code* code = compiler->code;
+      emit(code, cel0_OpCode_TestParallel);
+      int else_pc = emit(code, 0);
+      for (int i=begin; i<end; i++) {
+	cel0_Value* clause = lookupVectorMetadata(form_metadata->vector[i + 1].u.vector_id)->vector;
+	int slot = allocateRegister(compiler);
+	compileLoadConstant(compiler, placeHolderForRecursion(), slot);
+	pushLocalBinding(stack, clause, slot);
+	cel0_Value* params = appendValueToVectorInPlace(createVectorValue(), createVectorValue());
+	params = appendValueToVectorInPlace(params, clause + 1);
+	compileMakeClosure(compiler, params, slot);
+      }
+      emit(code, cel0_OpCode_ParallelCall);
+      emit(code, base);
+      emit(code, end - begin);
+      emit(code, cel0_OpCode_Jump);
+      end_pc = emit(code, 0);
+      code->instructions[else_pc] = code->instructions_size;
+      popSymbolBindings(stack, wave_stack_size);
+      compiler->next_register = base;
+    }
+    for (int i=begin; i<end; i++) {
+      cel0_Value* clause = lookupVectorMetadata(form_metadata->vector[i + 1].u.vector_id)->vector;
+      int slot = allocateRegister(compiler);
+      compileLoadConstant(compiler, placeHolderForRecursion(), slot);
+      pushLocalBinding(stack, clause, slot);
+      compileExpression(compiler, clause + 1, slot);
+    }
+    if (end_pc >= 0) compiler->code->instructions[end_pc] = compiler->code->instructions_size;
+  }
+  free(waves);
+  compileExpression(compiler, form_metadata->vector + form_metadata->size - 1, target);
+  popSymbolBindings(stack, caller_stack_size);
+  compiler->next_register = caller_next_register;
+}
+
+
+typedef struct cel0_Frame {
+  cel0_Code* code;
+  int pc;
+  int base;
+  cel0_Value closure;
+  /* The call instruction that entered this frame, for its trace entry. */
+  cel0_Code* call_code;
+  int call_pc;
+  /* The cache the result goes to on return, keyed by the parameters,
+     which such a frame never overwrites. */
+  struct cel0_MemoCache* memo;
+  unsigned memo_hash;
+  /* Index + 1 of the profile entry of the call, 0 if not profiled. */
+  int profile_entry;
+} cel0_Frame;
+
+/* Beyond this many nested calls into code compiled to C, callees are
+   interpreted on the heap frames instead of recursing further. */
+#define cel0_MaxCompiledDepth 2048
+
+typedef struct cel0_Machine {
+  cel0_SymbolBindingStack* stack;
+  cel0_Value* registers;
+  int registers_capacity;
+  cel0_Frame* frames;
+  int frames_size;
+  int frames_capacity;
+  /* Calls into code compiled to C nest on the C stack. */
+  int compiled_depth;
+  /* The machine whose native applied a closure on this one. */
+  struct cel0_Machine* caller;
+} cel0_Machine;
+
+static cel0_Value* createNativeNameValue(cel0_SymbolBinding* binding) {
+  char name[32];
+  sprintf(name, binding->type == cel0_SymbolBindingType_Native ? "@%p" : "#%p", (void*)(binding->u.expression));
+  return createSymbolValue(name);
+}
+
+static cel0_Value* copyPanicValue(cel0_Value* panic) {
+  assert(panic->type == cel0_ValueType_Panic);
+  cel0_VectorMetadata* panic_metadata = lookupVectorMetadata(panic->u.vector_id);
+  cel0_Value* value = createVectorValueWithSize(cel0_ValueType_Panic, panic_metadata->size);
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
+  memcpy(metadata->vector, panic_metadata->vector, panic_metadata->size * sizeof(cel0_Value));
+  return value;
+}
+
+static void ensureRegisters(cel0_Machine* machine, int size) {
+  machine->registers = growBuffer(machine->registers, &machine->registers_capacity,
+				  size, sizeof(cel0_Value));
+}
+
+static cel0_Frame* pushFrame(cel0_Machine* machine, cel0_Code* code, int base, cel0_Value closure) {
+  machine->frames = growBuffer(machine->frames, &machine->frames_capacity,
+			       machine->frames_size + 1, sizeof(cel0_Frame));
+  ensureRegisters(machine, base + code->register_count);
+  cel0_Frame* frame = machine->frames + machine->frames_size++;
+  *frame = (cel0_Frame) { .code = code, .pc = 0, .base = base, .closure = closure, .call_code = 0, .call_pc = 0 };
+  return frame;
+}
+
+/* A calling context tree of the closures and natives called while
+   profiling, named by the symbol they were called through. Calls nested
+   deeper than cel0_MaxProfileDepth count towards the node at that depth,
+   so deep recursion keeps the tree, and its folded stacks, small. */
+#define cel0_MaxProfileDepth 128
+#define cel0_ProfileAnonymous -1
+
+typedef struct cel0_ProfileNode {
+  int name;
+  int parent;
+  int first_child;
+  int next_sibling;
+  int depth;
+  long long calls;
+  long long exclusive_ns;
+  long long exclusive_allocations;
+} cel0_ProfileNode;
+
+typedef struct cel0_ProfileFunction {
+  long long calls;
+  long long inclusive_ns;
+  long long exclusive_ns;
+  long long allocations;
+  /* Calls running, so recursion only adds to inclusive time once. */
+  int active;
+} cel0_ProfileFunction;
+
+typedef struct cel0_ProfileEntry {
+  int name;
+  int node;
+  long long start_ns;
+  long long start_allocations;
+  long long children_ns;
+  long long children_allocations;
+} cel0_ProfileEntry;
+
+typedef struct cel0_Profile {
+  cel0_ProfileNode* nodes;
+  int nodes_size;
+  int nodes_capacity;
+  /* Indexed by name + 1. */
+  cel0_ProfileFunction* functions;
+  int functions_capacity;
+  cel0_ProfileEntry* entries;
+  int entries_size;
+  int entries_capacity;
+} cel0_Profile;
+
+static long long profileClock() {
+  struct timespec time;
+  clock_gettime(CLOCK_MONOTONIC, &time);
+  return time.tv_sec * 1000000000LL + time.tv_nsec;
+}
+
+static cel0_ProfileFunction* profileFunction(cel0_Profile* profile, int name) {
+  int capacity = profile->functions_capacity;
+  profile->functions = growBuffer(profile->functions, &profile->functions_capacity, name + 2, sizeof(cel0_ProfileFunction));
+  memset(profile->functions + capacity, 0, (profile->functions_capacity - capacity) * sizeof(cel0_ProfileFunction));
+  return profile->functions + name + 1;
+}
+
+/* Node 0 is the root, so 0 ends the lists of children. */
+static int profileChild(cel0_Profile* profile, int parent, int name) {
+  if (profile->nodes[parent].depth == cel0_MaxProfileDepth) return parent;
+  for (int child = profile->nodes[parent].first_child; child; child = profile->nodes[child].next_sibling)
+    if (profile->nodes[child].name == name) return child;
+  int node = profile->nodes_size++;
+  profile->nodes = growBuffer(profile->nodes, &profile->nodes_capacity, profile->nodes_size, sizeof(cel0_ProfileNode));
+  profile->nodes[node] = (cel0_ProfileNode) { .name = name, .parent = parent, .next_sibling = profile->nodes[parent].first_child,
+					      .depth = profile->nodes[parent].depth + 1 };
+  profile->nodes[parent].first_child = node;
+  return node;
+}
+
+/* Returns the index + 1 of the entry of the call. */
+static int enterProfile(int name) {
+  cel0_Profile* profile = g_context->profile;
+  int parent = profile->entries_size ? profile->entries[profile->entries_size - 1].node : 0;
+  int node = profileChild(profile, parent, name);
+  profile->nodes[node].calls++;
+  cel0_ProfileFunction* function = profileFunction(profile, name);
+  function->calls++;
+  function->active++;
+  profile->entries = growBuffer(profile->entries, &profile->entries_capacity, profile->entries_size + 1, sizeof(cel0_ProfileEntry));
+  profile->entries[profile->entries_size] = (cel0_ProfileEntry) { .name = name, .node = node, .start_ns = profileClock(),
+								  .start_allocations = g_context->allocations };
+  return ++profile->entries_size;
+}
+
+static void exitProfile(int entry_index) {
+  cel0_Profile* profile = g_context->profile;
+  assert(entry_index == profile->entries_size);
+  cel0_ProfileEntry* entry = profile->entries + --profile->entries_size;
+  long long elapsed_ns = profileClock() - entry->start_ns;
+  long long allocations = g_context->allocations - entry->start_allocations;
+  cel0_ProfileNode* node = profile->nodes + entry->node;
+  node->exclusive_ns += elapsed_ns - entry->children_ns;
+  node->exclusive_allocations += allocations - entry->children_allocations;
+  cel0_ProfileFunction* function = profileFunction(profile, entry->name);
+  function->exclusive_ns += elapsed_ns - entry->children_ns;
+  function->allocations += allocations - entry->children_allocations;
+  if (--function->active == 0) function->inclusive_ns += elapsed_ns;
+  if (profile->entries_size) {
+    entry[-1].children_ns += elapsed_ns;
+    entry[-1].children_allocations += allocations;
+  }
+}
+
+static void popFrame(cel0_Machine* machine) {
+  cel0_Frame* frame = machine->frames + --machine->frames_size;
+  if (frame->profile_entry) exitProfile(frame->profile_entry);
+}
+
+/* A bounded hash table of argument lists, evicting the least recently
+   used entry when full. Arguments are compared by structure, so a vector
+   rebuilt with the same elements hits. Panics are never cached, since
+   their trace grows as they unwind. */
+typedef struct cel0_MemoEntry {
+  unsigned hash;
+  /* Index + 1 of the next entry of the same bucket, 0 if none. */
+  int chained;
+  /* Neighbours in order of use, -1 past either end. */
+  int newer;
+  int older;
+  cel0_Value result;
+} cel0_MemoEntry;
+
+typedef struct cel0_MemoCache {
+  int capacity;
+  int argument_count;
+  cel0_MemoEntry* entries;
+  int entries_size;
+  int entries_capacity;
+  /* argument_count values per entry. */
+  cel0_Value* arguments;
+  int arguments_capacity;
+  /* Index + 1 of the first entry of each bucket. */
+  int* buckets;
+  int bucket_count;
+  int newest;
+  int oldest;
+} cel0_MemoCache;
+
+static cel0_MemoCache* createMemoCache(int capacity, int argument_count) {
+  cel0_MemoCache* memo = calloc(1, sizeof(cel0_MemoCache));
+  assert(memo);
+  memo->capacity = capacity;
+  memo->argument_count = argument_count;
+  memo->newest = memo->oldest = -1;
+  return memo;
+}
+
+static void freeMemoCache(cel0_MemoCache* memo) {
+  free(memo->entries);
+  free(memo->arguments);
+  free(memo->buckets);
+  free(memo);
+}
+
+static cel0_Value vectorElement(cel0_VectorMetadata* metadata, int i) {
+  unsigned char* bytes = metadata->bytes;
+  return bytes ? numberValue(bytes[i]) : metadata->vector[i];
+}
+
+static unsigned hashValues(cel0_Value* values, int size) {
+  unsigned hash = 2166136261u;
+  for (int i=0; i<size; i++) {
+    hash = (hash ^ values[i].type) * 16777619u;
+    if (values[i].type == cel0_ValueType_Vector) {
+      cel0_VectorMetadata* metadata = peekVectorMetadata(values[i].u.vector_id);
+      hash = (hash ^ metadata->size) * 16777619u;
+      for (int j=0; j<metadata->size; j++) {
+	cel0_Value element = vectorElement(metadata, j);
+	hash = (hash ^ hashValues(&element, 1)) * 16777619u;
+      }
+    } else {
+      hash = (hash ^ (unsigned)values[i].u.number) * 16777619u;
+    }
+  }
+  return hash;
+}
+
+static char valuesEqual(cel0_Value* a, cel0_Value* b, int size) {
+  for (int i=0; i<size; i++) {
+    if (a[i].type != b[i].type) return 0;
+    if (a[i].u.number == b[i].u.number) continue;
+    if (a[i].type != cel0_ValueType_Vector) return 0;
+    cel0_VectorMetadata* a_metadata = peekVectorMetadata(a[i].u.vector_id);
+    cel0_VectorMetadata* b_metadata = peekVectorMetadata(b[i].u.vector_id);
+    if (a_metadata->size != b_metadata->size) return 0;
+    for (int j=0; j<a_metadata->size; j++) {
+      cel0_Value a_element = vectorElement(a_metadata, j);
+      cel0_Value b_element = vectorElement(b_metadata, j);
+      if (!valuesEqual(&a_element, &b_element, 1)) return 0;
+    }
+  }
+  return 1;
+}
+
+static void unlinkMemoEntry(cel0_MemoCache* memo, int index) {
+  cel0_MemoEntry* entry = memo->entries + index;
+  if (entry->newer >= 0) memo->entries[entry->newer].older = entry->older;
+  else memo->newest = entry->older;
+  if (entry->older >= 0) memo->entries[entry->older].newer = entry->newer;
+  else memo->oldest = entry->newer;
+}
+
+static void linkNewestMemoEntry(cel0_MemoCache* memo, int index) {
+  cel0_MemoEntry* entry = memo->entries + index;
+  entry->newer = -1;
+  entry->older = memo->newest;
+  if (memo->newest >= 0) memo->entries[memo->newest].newer = index;
+  else memo->oldest = index;
+  memo->newest = index;
+}
+
+/* Index of the entry for arguments, -1 if none. Called under lock. */
+static int findMemoEntry(cel0_MemoCache* memo, unsigned hash, cel0_Value* arguments) {
+  if (!memo->bucket_count) return -1;
+  int index = memo->buckets[hash & (memo->bucket_count - 1)] - 1;
+  for (; index >= 0; index = memo->entries[index].chained - 1) {
+    if (memo->entries[index].hash == hash &&
+	valuesEqual(memo->arguments + index * memo->argument_count, arguments, memo->argument_count))
+      return index;
+  }
+  return -1;
+}
+
+static char lookupMemo(cel0_MemoCache* memo, unsigned hash, cel0_Value* arguments, cel0_Value* result) {
+  lockContext();
+  int index = findMemoEntry(memo, hash, arguments);
+  if (index >= 0) {
+    unlinkMemoEntry(memo, index);
+    linkNewestMemoEntry(memo, index);
+    *result = memo->entries[index].result;
+  }
+  unlockContext();
+  return index >= 0;
+}
+
+static void rehashMemoCache(cel0_MemoCache* memo, int bucket_count) {
+  free(memo->buckets);
+  memo->buckets = calloc(bucket_count, sizeof(int));
+  assert(memo->buckets);
+  memo->bucket_count = bucket_count;
+  for (int i=0; i<memo->entries_size; i++) {
+    int* bucket = memo->buckets + (memo->entries[i].hash & (bucket_count - 1));
+    memo->entries[i].chained = *bucket;
+    *bucket = i + 1;
+  }
+}
+
+static void storeMemo(cel0_MemoCache* memo, unsigned hash, cel0_Value* arguments, cel0_Value result) {
+  if (result.type == cel0_ValueType_Panic) return;
+  lockContext();
+  if (findMemoEntry(memo, hash, arguments) >= 0) {
+    unlockContext();
+    return;
+  }
+  int index;
+  if (memo->entries_size < memo->capacity) {
+    if (memo->entries_size == memo->bucket_count)
+      rehashMemoCache(memo, memo->bucket_count ? memo->bucket_count * 2 : 16);
+    index = memo->entries_size++;
+    memo->entries = growBuffer(memo->entries, &memo->entries_capacity, memo->entries_size, sizeof(cel0_MemoEntry));
+    memo->arguments = growBuffer(memo->arguments, &memo->arguments_capacity,
+				 memo->entries_size * memo->argument_count + 1, sizeof(cel0_Value));
+  } else {
+    index = memo->oldest;
+    unlinkMemoEntry(memo, index);
+    int* link = memo->buckets + (memo->entries[index].hash & (memo->bucket_count - 1));
+    while (*link != index + 1) link = &memo->entries[*link - 1].chained;
+    *link = memo->entries[index].chained;
+  }
+  cel0_MemoEntry* entry = memo->entries + index;
+  entry->hash = hash;
+  entry->result = result;
+  if (memo->argument_count)
+    memcpy(memo->arguments + index * memo->argument_count, arguments, memo->argument_count * sizeof(cel0_Value));
+  int* bucket = memo->buckets + (hash & (memo->bucket_count - 1));
+  entry->chained = *bucket;
+  *bucket = index + 1;
+  linkNewestMemoEntry(memo, index);
+  unlockContext();
+}
+
+/* pmap and preduce split their vector into chunks whose number depends
+   only on its length, so preduce combines the same partial results
+   whatever the number of workers. */
+#define cel0_ParallelChunks 256
+#define cel0_MaxWorkers 256
+
+#define cel0_JobKind_Map 0    /* applies function to each element */
+#define cel0_JobKind_Reduce 1 /* folds function over each chunk */
+#define cel0_JobKind_Call 2   /* applies each element to no arguments as function */
+
+typedef struct cel0_ParallelJob {
+  int kind;
+  cel0_Value function;
+  cel0_Value* elements;
+  int size;
+  int chunk_size;
+  int chunk_count;
+  /* Rooted: the result of each element, or the accumulator of each chunk
+     when reducing. */
+  cel0_Value* results;
+  /* The lowest element (chunk when reducing) whose result is a panic,
+     past the last one if none. Later ones are not evaluated. */
+  int panic_index;
+} cel0_ParallelJob;
+
+typedef struct cel0_Worker {
+  struct cel0_Pool* pool;
+  pthread_t thread;
+  /* Chunks not taken yet. The worker takes them from the front, thieves
+     from the back. */
+  pthread_mutex_t lock;
+  int begin;
+  int end;
+  /* The chunk being evaluated and its next element, -1 if none. */
+  int chunk;
+  int next;
+  cel0_Roots roots;
+} cel0_Worker;
+
+typedef struct cel0_Pool {
+  cel0_Context* context;
+  cel0_Worker* workers;
+  int size;
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  /* Signaled when a worker finishes its round or parks. */
+  pthread_cond_t changed;
+  pthread_cond_t resumed;
+  int round;
+  int running;
+  /* Workers waiting at a safepoint while another one collects. */
+  int parked;
+  char stopping;
+  int collections;
+  char shutdown;
+  cel0_ParallelJob* job;
+} cel0_Pool;
+
+#define cel0_MinCollectionThreshold (1<<16)
+#define cel0_MaxReusedBufferSize 64
+
+static int markValues(cel0_Value* values, int size, int mark_stack_size) {
+  for (int i=0; i<size; i++) {
+    if (values[i].type != cel0_ValueType_Vector && values[i].type != cel0_ValueType_Panic) continue;
+    cel0_VectorMetadata* metadata = g_context->vector_metadata + values[i].u.vector_id;
+    if (!metadata->live || metadata->marked) continue;
+    metadata->marked = 1;
+    g_context->mark_stack = growBuffer(g_context->mark_stack, &g_context->mark_stack_capacity, mark_stack_size + 1, sizeof(int));
+    g_context->mark_stack[mark_stack_size++] = values[i].u.vector_id;
+  }
+  return mark_stack_size;
+}
+
+static int markMemoCache(cel0_MemoCache* memo, int mark_stack_size) {
+  mark_stack_size = markValues(memo->arguments, memo->entries_size * memo->argument_count, mark_stack_size);
+  for (int i=0; i<memo->entries_size; i++)
+    mark_stack_size = markValues(&memo->entries[i].result, 1, mark_stack_size);
+  return mark_stack_size;
+}
+
+static int markRoots(cel0_Roots* roots, int mark_stack_size) {
+  for (cel0_Machine* machine = roots->machine; machine; machine = machine->caller) {
+    for (int i=0; i<machine->frames_size; i++) {
+      cel0_Frame* frame = machine->frames + i;
+      mark_stack_size = markValues(machine->registers + frame->base, frame->code->register_count, mark_stack_size);
+      mark_stack_size = markValues(&frame->closure, 1, mark_stack_size);
+    }
+  }
+  return markValues(roots->pinned, roots->pinned_size, mark_stack_size);
+}
+
+/* Waits at a safepoint until every other running worker is at one.
+   Returns 0 if another worker collected meanwhile. */
+static char stopWorkers() {
+  cel0_Pool* pool = g_context->pool;
+  pthread_mutex_lock(&pool->lock);
+  if (pool->stopping) {
+    int collections = pool->collections;
+    pool->parked++;
+    pthread_cond_broadcast(&pool->changed);
+    while (pool->collections == collections) pthread_cond_wait(&pool->resumed, &pool->lock);
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+  if (allocationsSinceCollection() < g_context->collection_threshold) {
+    pthread_mutex_unlock(&pool->lock);
+    return 0;
+  }
+  pool->stopping = 1;
+  while (pool->parked < pool->running - 1) pthread_cond_wait(&pool->changed, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  return 1;
+}
+
+static void resumeWorkers() {
+  cel0_Pool* pool = g_context->pool;
+  pthread_mutex_lock(&pool->lock);
+  pool->stopping = 0;
+  pool->parked = 0;
+  pool->collections++;
+  pthread_cond_broadcast(&pool->resumed);
+  pthread_mutex_unlock(&pool->lock);
+}
+
+/* Mark and sweep over vector ids. The roots are those of the owning
+   thread and of every pool worker, which are first stopped at
+   safepoints: the registers of every live frame, the closures they run,
+   the pinned values, and the constants of compiled code. Registers a
+   frame has not written yet are cleared when it is pushed, so they never
+   hold ids collected earlier. */
+static void collectGarbage() {
+  if (g_context->parallel && !stopWorkers()) return;
+  int mark_stack_size = markRoots(&g_context->roots, 0);
+  cel0_Pool* pool = g_context->pool;
+  for (int i=0; pool && pool->workers && i<pool->size; i++)
+    mark_stack_size = markRoots(&pool->workers[i].roots, mark_stack_size);
+  for (int i=0; i<g_context->codes_size; i++) {
+    cel0_Code* code = g_context->codes[i];
+    mark_stack_size = markValues(code->constants, code->constants_size, mark_stack_size);
+    for (int j=0; j<code->regions_size; j++)
+      mark_stack_size = markValues(&code->regions[j].form, 1, mark_stack_size);
+    for (int j=0; j<code->functions_size; j++) {
+      mark_stack_size = markValues(&code->functions[j]->lambda_list, 1, mark_stack_size);
+      mark_stack_size = markValues(&code->functions[j]->body, 1, mark_stack_size);
+    }
+  }
+  while (mark_stack_size > 0) {
+    cel0_VectorMetadata* metadata = g_context->vector_metadata + g_context->mark_stack[--mark_stack_size];
+    if (metadata->memo) mark_stack_size = markMemoCache(metadata->memo, mark_stack_size);
+    if (metadata->bytes) continue;
+    mark_stack_size = markValues(metadata->vector, metadata->size, mark_stack_size);
+  }
+
+  for (int i=0; i<g_context->vector_metadata_number; i++) {
+    cel0_VectorMetadata* metadata = g_context->vector_metadata + i;
+    if (!metadata->live) continue;
+    /* No worker runs during a collection, so none reads the mapping of a
+       vector widened while they did. */
+    if (metadata->mapping && !metadata->bytes) unmapByteVector(metadata);
+    if (metadata->marked) {
+      metadata->marked = 0;
+      continue;
+    }
+    if (metadata->mapping) unmapByteVector(metadata);
+    cel0_VectorBuffer* buffer = metadata->buffer;
+    if (buffer && (buffer->references > 1 || buffer->capacity > cel0_MaxReusedBufferSize))
+      releaseVectorBuffer(metadata);
+    if (metadata->memo) freeMemoCache(metadata->memo);
+    metadata->memo = 0;
+    metadata->live = 0;
+    metadata->function = 0;
+    metadata->size = g_context->free_vector_metadata;
+    g_context->free_vector_metadata = i;
+    g_context->live_vector_metadata_number--;
+    g_context->memory.live[(int)metadata->type]--;
+  }
+  scratchValues();
+  freeAllValues();
+
+  atomic_store_explicit(&g_context->allocations_since_collection, 0, memory_order_relaxed);
+  int headroom = cel0_MaxVectorMetadataLength - g_context->live_vector_metadata_number;
+  g_context->collection_threshold = g_context->live_vector_metadata_number > cel0_MinCollectionThreshold ?
+    g_context->live_vector_metadata_number : cel0_MinCollectionThreshold;
+  if (g_context->collection_threshold > headroom / 2) g_context->collection_threshold = headroom / 2;
+  if (g_context->parallel) resumeWorkers();
+}
+
+static void clearRegisters(cel0_Value* registers, int begin, int end) {
+  for (int i=begin; i<end; i++)
+    registers[i].type = cel0_ValueType_Number;
+}
+
+/* Appends to panic the trace entries that the recursive evaluator used to
+   add while returning it: the enclosing transforms of each frame down to
+   the one at depth, and the call that entered the frame. */
+static void unwindPanic(cel0_Machine* machine, cel0_Value* panic, int depth) {
+  for (;;) {
+    cel0_Frame* frame = machine->frames + machine->frames_size - 1;
+    cel0_Code* code = frame->code;
+    for (int i=0; i<code->regions_size; i++) {
+      cel0_TraceRegion* region = code->regions + i;
+      if (region->begin <= frame->pc && frame->pc < region->end)
+	appendValueToVectorInPlace(panic, &region->form);
+    }
+    /* The first frame of a machine applying a closure has a call only if
+       it was replaced by a tail call. */
+    if (frame->call_code) {
+      int* call = frame->call_code->instructions + frame->call_pc;
+      assert(call[0] == cel0_OpCode_Call || call[0] == cel0_OpCode_TailCall);
+      appendValueToVectorInPlace(panic, createCallPanicStackEntry(frame->call_code->constants + call[5],
+								    machine->registers + frame->base, call[4]));
+    }
+    if (machine->frames_size == depth) return;
+    popFrame(machine);
+  }
+}
+
+/* The compiled function of a closure, or 0 if the closure is ill-formed. */
+static cel0_Function* closureFunction(cel0_Value closure, cel0_SymbolBindingStack* stack) {
+  cel0_VectorMetadata* closure_metadata = lookupVectorMetadata(closure.u.vector_id);
+  if (closure_metadata->size != 2 ||
+      closure_metadata->vector[0].type != cel0_ValueType_Vector)
+    return 0;
+  if (!closure_metadata->function) {
+    lockContext();
+    if (!closure_metadata->function)
+      closure_metadata->function = compileClosure(&closure, stack);
+    unlockContext();
+  }
+  return closure_metadata->function;
+}
+
+/* Fills the registers of a frame entered through closure that follow its
+   arguments: the captured bindings, then the closure itself. */
+static void loadClosureRegisters(cel0_Value* registers, cel0_Function* function, cel0_Value closure) {
+  cel0_VectorMetadata* closure_metadata = lookupVectorMetadata(closure.u.vector_id);
+  cel0_VectorMetadata* lambda_list_metadata = lookupVectorMetadata(closure_metadata->vector->u.vector_id);
+  for (int i=function->parameter_count; i<function->lambda_list_size; i++)
+    registers[i] = lookupVectorMetadata(lambda_list_metadata->vector[i].u.vector_id)->vector[1];
+  registers[function->lambda_list_size] = closure;
+  clearRegisters(registers, function->lambda_list_size + 1, function->code->register_count);
+}
+
+/* Builds ((parameters... (symbol value)...) body) for function. Its
+   captures were found when it was compiled, so this only copies their
+   current values, into vectors allocated at their final sizes. */
+static cel0_Value createClosureValue(cel0_Function* function, cel0_Value* registers) {
+  cel0_Value* lambda_list = createVectorValueWithSize(cel0_ValueType_Vector, function->lambda_list_size);
+  cel0_Value* lambda_list_vector = lookupVectorMetadata(lambda_list->u.vector_id)->vector;
+  if (function->parameter_count)
+    memcpy(lambda_list_vector, lookupVectorMetadata(function->lambda_list.u.vector_id)->vector,
+	   function->parameter_count * sizeof(cel0_Value));
+  for (int i=0; i<function->capture_count; i++) {
+    cel0_Value* entry = createVectorValueWithSize(cel0_ValueType_Vector, 2);
+    cel0_Value* entry_vector = lookupVectorMetadata(entry->u.vector_id)->vector;
+    entry_vector[0] = function->capture_symbols[i];
+    entry_vector[1] = function->capture_registers[i] < 0 ?
+      *placeHolderForRecursion() : registers[function->capture_registers[i]];
+    lambda_list_vector[function->parameter_count + i] = *entry;
+  }
+  cel0_Value* closure = createVectorValueWithSize(cel0_ValueType_Vector, 2);
+  cel0_VectorMetadata* closure_metadata = lookupVectorMetadata(closure->u.vector_id);
+  closure_metadata->vector[0] = *lambda_list;
+  closure_metadata->vector[1] = function->body;
+  closure_metadata->function = function;
+  if (function->memo_capacity)
+    closure_metadata->memo = createMemoCache(function->memo_capacity, function->parameter_count);
+  return *closure;
+}
+
+static int applyClosures(cel0_Value* closures, int count, cel0_Value self);
+static char canRunInParallel();
+
+/* Enters the callee of the Call or TailCall at pc in the top frame:
+   pushes its frame, or replaces the top one for a tail call, with its
+   registers set. Returns 0 instead, with result set to the cached result
+   or to a panic of the calling frame, when there is no frame to run. */
+static cel0_Function* enterCall(cel0_Machine* machine, int pc, cel0_Value* result) {
+  cel0_Frame* frame = machine->frames + machine->frames_size - 1;
+  frame->pc = pc;
+  cel0_Code* code = frame->code;
+  int* instruction = code->instructions + pc;
+  cel0_Value* registers = machine->registers + frame->base;
+  cel0_Value closure = registers[instruction[2]];
+  if (closure.type == cel0_ValueType_Symbol && closure.u.symbol_id == cel0_Symbol_SelfRec) {
+    if (frame->closure.type != cel0_ValueType_Vector) {
+      *result = *createPanicValue("self-rec-binding");
+      return 0;
+    }
+    closure = frame->closure;
+  }
+  assert(closure.type == cel0_ValueType_Vector);
+  cel0_Value* arguments = registers + instruction[3];
+  int argument_count = instruction[4];
+  cel0_Function* function = closureFunction(closure, machine->stack);
+  if (!function) {
+    *result = *appendValueToVectorInPlace(createPanicValue("ill-formed"),
+					  createCallPanicStackEntry(code->constants + instruction[5], arguments, argument_count));
+    return 0;
+  }
+  if (function->parameter_count != argument_count) {
+    *result = *appendValueToVectorInPlace(createPanicValue("number-params"),
+					  createCallPanicStackEntry(code->constants + instruction[5], arguments, argument_count));
+    return 0;
+  }
+  int profile_name = cel0_ProfileAnonymous;
+  if (g_context->profile && code->constants[instruction[5]].type == cel0_ValueType_Symbol)
+    profile_name = code->constants[instruction[5]].u.symbol_id;
+  cel0_MemoCache* memo = lookupVectorMetadata(closure.u.vector_id)->memo;
+  unsigned memo_hash = 0;
+  if (memo) {
+    memo_hash = hashValues(arguments, argument_count);
+    if (lookupMemo(memo, memo_hash, arguments, result)) {
+      if (g_context->profile) exitProfile(enterProfile(profile_name));
+      return 0;
+    }
+  }
+
+  /* A frame caching its result must return to store it. */
+  if (instruction[0] == cel0_OpCode_TailCall && !frame->memo) {
+    /* The trace entries of the replaced frame are dropped with it. */
+    if (frame->profile_entry) exitProfile(frame->profile_entry);
+    memmove(registers, arguments, argument_count * sizeof(cel0_Value));
+    *frame = (cel0_Frame) { .code = function->code, .pc = 0, .base = frame->base, .closure = closure };
+    ensureRegisters(machine, frame->base + function->code->register_count);
+  } else {
+    frame = pushFrame(machine, function->code, frame->base + instruction[3], closure);
+  }
+  frame->call_code = code;
+  frame->call_pc = pc;
+  frame->memo = memo;
+  frame->memo_hash = memo_hash;
+  if (g_context->profile) frame->profile_entry = enterProfile(profile_name);
+  loadClosureRegisters(machine->registers + frame->base, function, closure);
+  return function;
+}
+
+static cel0_Value profileNative(cel0_SymbolBinding* binding, cel0_Value* arguments, int argument_count,
+				cel0_SymbolBindingStack* stack) {
+  int profile_entry = enterProfile(binding->symbol->u.symbol_id);
+  cel0_Value returned = binding->u.native.expression(arguments, argument_count, stack);
+  exitProfile(profile_entry);
+  return returned;
+}
+
+static cel0_Value callNative(cel0_Machine* machine, int* instruction, cel0_Value* registers) {
+  cel0_SymbolBinding* binding = machine->stack->frames + instruction[2];
+  cel0_Value* arguments = registers + instruction[3];
+  cel0_Value returned = g_context->profile ? profileNative(binding, arguments, instruction[4], machine->stack) :
+    binding->u.native.expression(arguments, instruction[4], machine->stack);
+  if (returned.type == cel0_ValueType_Panic)
+    appendValueToVectorInPlace(&returned, createCallPanicStackEntry(binding->symbol, arguments, instruction[4]));
+  return returned;
+}
+
+static cel0_Value runTop(cel0_Machine* machine);
+
+/* Runs the frame on top of machine, with its registers set, and the
+   frames it calls until it returns or a panic unwinds it. */
+static cel0_Value run(cel0_Machine* machine) {
+  int depth = machine->frames_size;
+  cel0_Frame* frame = machine->frames + depth - 1;
+  cel0_Code* code = frame->code;
+  cel0_Value* registers = machine->registers + frame->base;
+  int pc = 0;
+  cel0_Value* panic = 0;
+  cel0_Value returned;
+
+  for (;;) {
+    if (allocationsSinceCollection() >= g_context->collection_threshold)
+      collectGarbage();
+    int* instruction = code->instructions + pc;
+    switch (instruction[0]) {
+    case cel0_OpCode_LoadConstant:
+      registers[instruction[1]] = code->constants[instruction[2]];
+      pc += 3;
+      break;
+    case cel0_OpCode_Move:
+      registers[instruction[1]] = registers[instruction[2]];
+      pc += 3;
+      break;
+    case cel0_OpCode_LoadNativeName:
+      registers[instruction[1]] = *createNativeNameValue(machine->stack->frames + instruction[2]);
+      pc += 3;
+      break;
+    case cel0_OpCode_CallNative: {
+      returned = callNative(machine, instruction, registers);
+      if (returned.type == cel0_ValueType_Panic) {
+	panic = &returned;
+	break;
+      }
+      registers[instruction[1]] = returned;
+      pc += 5;
+      break;
+    }
+    case cel0_OpCode_Call:
+    case cel0_OpCode_TailCall: {
+      if (!enterCall(machine, pc, &returned)) {
+	if (returned.type == cel0_ValueType_Panic) {
+	  panic = &returned;
+	  break;
+	}
+	registers[instruction[1]] = returned;
+	pc += 6;
+	break;
+      }
+      frame = machine->frames + machine->frames_size - 1;
+      code = frame->code;
+      registers = machine->registers + frame->base;
+      pc = 0;
+      if (!code->compiled || machine->compiled_depth >= cel0_MaxCompiledDepth) break;
+
+      /* Code compiled to C runs its frame to completion. */
+      returned = runTop(machine);
+      if (machine->frames_size < depth) return returned;
+      frame = machine->frames + machine->frames_size - 1;
+      code = frame->code;
+      registers = machine->registers + frame->base;
+      pc = frame->pc;
+      if (returned.type == cel0_ValueType_Panic) {
+	panic = &returned;
+	break;
+      }
+      registers[code->instructions[pc + 1]] = returned;
+      pc += 6;
+      break;
+    }
+    case cel0_OpCode_Test: {
+      cel0_Value condition = registers[instruction[1]];
+      if (condition.type != cel0_ValueType_Symbol) {
+	panic = createPanicValue("condition-non-symbol");
+	break;
+      }
+      char condition_true = condition.u.symbol_id == cel0_Symbol_True;
+      char condition_false = !condition_true && (condition.u.symbol_id == cel0_Symbol_False);
+      assert(condition_true || condition_false);
+      pc = condition_true ? pc + 3 : instruction[2];
+      break;
+    }
+    case cel0_OpCode_Jump:
+      pc = instruction[1];
+      break;
+    case cel0_OpCode_MakeClosure:
+      registers[instruction[1]] = createClosureValue(code->functions[instruction[2]], registers);
+      pc += 3;
+      break;
+    case cel0_OpCode_Panic:
+      panic = copyPanicValue(code->constants + instruction[1]);
+      break;
+    case cel0_OpCode_TestParallel:
+      pc = canRunInParallel() ? pc + 2 : instruction[1];
+      break;
+    case cel0_OpCode_ParallelCall: {
+      int panic_index = applyClosures(registers + instruction[1], instruction[2], frame->closure);
+      if (panic_index >= 0) {
+	panic = registers + instruction[1] + panic_index;
+	break;
+      }
+      pc += 3;
+      break;
+    }
+    case cel0_OpCode_Return: {
+      cel0_Value result = registers[instruction[1]];
+      if (frame->memo) storeMemo(frame->memo, frame->memo_hash, registers, result);
+      if (machine->frames_size == depth) {
+	popFrame(machine);
+	return result;
+      }
+      popFrame(machine);
+      frame = machine->frames + machine->frames_size - 1;
+      code = frame->code;
+      registers = machine->registers + frame->base;
+      pc = frame->pc;
+      registers[code->instructions[pc + 1]] = result;
+      pc += 6;
+      break;
+    }
+    default:
+      assert(0);
+    }
+
+    if (panic) {
+      frame->pc = pc;
+      unwindPanic(machine, panic, depth);
+      popFrame(machine);
+      return *panic;
+    }
+  }
+}
+
+/* Code compiled to C returns cel0_ValueType_TailCall after replacing its
+   frame, whose new code runs next. */
+static cel0_Value runTop(cel0_Machine* machine) {
+  for (;;) {
+    cel0_Code* code = machine->frames[machine->frames_size - 1].code;
+    if (!code->compiled || machine->compiled_depth >= cel0_MaxCompiledDepth) return run(machine);
+    machine->compiled_depth++;
+    cel0_Value value = code->compiled(machine, code->constants);
+    machine->compiled_depth--;
+    if (value.type != cel0_ValueType_TailCall) return value;
+  }
+}
+
+void cel0_safepoint(void) {
+  if (allocationsSinceCollection() >= g_context->collection_threshold)
+    collectGarbage();
+}
+
+cel0_Value* cel0_registers(cel0_Machine* machine) {
+  return machine->registers + machine->frames[machine->frames_size - 1].base;
+}
+
+static int* topInstruction(cel0_Machine* machine, int pc) {
+  return machine->frames[machine->frames_size - 1].code->instructions + pc;
+}
+
+cel0_Value cel0_loadNativeName(cel0_Machine* machine, int pc) {
+  return *createNativeNameValue(machine->stack->frames + topInstruction(machine, pc)[2]);
+}
+
+cel0_Value cel0_callNative(cel0_Machine* machine, int pc) {
+  return callNative(machine, topInstruction(machine, pc), cel0_registers(machine));
+}
+
+cel0_Value cel0_call(cel0_Machine* machine, int pc) {
+  cel0_Value result;
+  if (!enterCall(machine, pc, &result)) return result;
+  return runTop(machine);
+}
+
+cel0_Value cel0_tailCall(cel0_Machine* machine, int pc) {
+  int depth = machine->frames_size;
+  cel0_Value result;
+  if (!enterCall(machine, pc, &result)) return result;
+  if (machine->frames_size > depth) return runTop(machine);
+  return (cel0_Value) { .type = cel0_ValueType_TailCall };
+}
+
+cel0_Value cel0_makeClosure(cel0_Machine* machine, int pc) {
+  cel0_Code* code = machine->frames[machine->frames_size - 1].code;
+  return createClosureValue(code->functions[code->instructions[pc + 2]], cel0_registers(machine));
+}
+
+char cel0_testParallel(void) {
+  return canRunInParallel();
+}
+
+cel0_Value cel0_parallelCall(cel0_Machine* machine, int pc) {
+  int* instruction = topInstruction(machine, pc);
+  cel0_Value* registers = cel0_registers(machine);
+  int panic_index = applyClosures(registers + instruction[1], instruction[2],
+				  machine->frames[machine->frames_size - 1].closure);
+  return panic_index >= 0 ? registers[instruction[1] + panic_index] : numberValue(0);
+}
+
+cel0_Value cel0_panic(cel0_Machine* machine, int pc) {
+  cel0_Code* code = machine->frames[machine->frames_size - 1].code;
+  int* instruction = code->instructions + pc;
+  cel0_Value* panic = instruction[0] == cel0_OpCode_Panic ?
+    copyPanicValue(code->constants + instruction[1]) : createPanicValue("condition-non-symbol");
+  return cel0_unwind(machine, pc, *panic);
+}
+
+cel0_Value cel0_unwind(cel0_Machine* machine, int pc, cel0_Value panic) {
+  machine->frames[machine->frames_size - 1].pc = pc;
+  unwindPanic(machine, &panic, machine->frames_size);
+  popFrame(machine);
+  return panic;
+}
+
+cel0_Value cel0_return(cel0_Machine* machine, cel0_Value value) {
+  cel0_Frame* frame = machine->frames + machine->frames_size - 1;
+  if (frame->memo) storeMemo(frame->memo, frame->memo_hash, cel0_registers(machine), value);
+  popFrame(machine);
+  return value;
+}
+
+static cel0_SymbolBindingStack* globalBindings();
+
+/* Applies closure to arguments on a machine of its own, for natives that
+   call back into the program. Its frame runs as self, the closure that
+   #self-rec stands for. */
+static cel0_Value applyClosureAs(cel0_Value closure, cel0_Value self, cel0_Value* arguments, int argument_count) {
+  if (closure.type != cel0_ValueType_Vector) return *createPanicValue("ill-formed");
+  cel0_SymbolBindingStack* stack = globalBindings();
+  cel0_Function* function = closureFunction(closure, stack);
+  if (!function) return *createPanicValue("ill-formed");
+  if (function->parameter_count != argument_count) return *createPanicValue("number-params");
+  cel0_MemoCache* memo = lookupVectorMetadata(closure.u.vector_id)->memo;
+  unsigned memo_hash = 0;
+  cel0_Value cached;
+  if (memo) {
+    memo_hash = hashValues(arguments, argument_count);
+    if (lookupMemo(memo, memo_hash, arguments, &cached)) return cached;
+  }
+
+  cel0_Machine machine = { .stack = stack };
+  cel0_Frame* frame = pushFrame(&machine, function->code, 0, self);
+  frame->memo = memo;
+  frame->memo_hash = memo_hash;
+  if (g_context->profile) frame->profile_entry = enterProfile(cel0_ProfileAnonymous);
+  if (argument_count)
+    memcpy(machine.registers, arguments, argument_count * sizeof(cel0_Value));
+  loadClosureRegisters(machine.registers, function, closure);
+  machine.registers[function->lambda_list_size] = self;
+  machine.caller = g_roots->machine;
+  g_roots->machine = &machine;
+  cel0_Value result = runTop(&machine);
+  g_roots->machine = machine.caller;
+  free(machine.registers);
+  free(machine.frames);
+  return result;
+}
+
+static cel0_Value applyClosure(cel0_Value closure, cel0_Value* arguments, int argument_count) {
+  return applyClosureAs(closure, closure, arguments, argument_count);
+}
+
+/* Keeps value alive across the collections of closures a native applies. */
+static void pinValue(cel0_Value value) {
+  g_roots->pinned = growBuffer(g_roots->pinned, &g_roots->pinned_capacity,
+			       g_roots->pinned_size + 1, sizeof(cel0_Value));
+  g_roots->pinned[g_roots->pinned_size++] = value;
+}
+
+static void unpinValue() {
+  g_roots->pinned_size--;
+}
+
+
+static int jobChunkEnd(cel0_ParallelJob* job, int chunk) {
+  int end = (chunk + 1) * job->chunk_size;
+  return end < job->size ? end : job->size;
+}
+
+static char isJobElementNeeded(cel0_ParallelJob* job, int chunk, int i) {
+  return (job->kind == cel0_JobKind_Reduce ? chunk : i) < job->panic_index;
+}
+
+static void evaluateJobElement(cel0_ParallelJob* job, int chunk, int i) {
+  cel0_Value* result;
+  if (job->kind == cel0_JobKind_Map) {
+    result = job->results + i;
+    *result = applyClosure(job->function, job->elements + i, 1);
+  } else if (job->kind == cel0_JobKind_Call) {
+    result = job->results + i;
+    *result = applyClosureAs(job->elements[i], job->function, 0, 0);
+  } else {
+    result = job->results + chunk;
+    if (i == chunk * job->chunk_size) {
+      *result = job->elements[i];
+    } else {
+      cel0_Value arguments[2] = { *result, job->elements[i] };
+      *result = applyClosure(job->function, arguments, 2);
+    }
+  }
+  if (result->type != cel0_ValueType_Panic) return;
+  lockContext();
+  int index = job->kind == cel0_JobKind_Reduce ? chunk : i;
+  if (index < job->panic_index) job->panic_index = index;
+  unlockContext();
+}
+
+static void runJobSequentially(cel0_ParallelJob* job) {
+  for (int chunk=0; chunk<job->chunk_count; chunk++) {
+    int end = jobChunkEnd(job, chunk);
+    for (int i=chunk*job->chunk_size; i<end && isJobElementNeeded(job, chunk, i); i++)
+      evaluateJobElement(job, chunk, i);
+  }
+}
+
+static char takeChunk(cel0_Worker* worker, cel0_ParallelJob* job) {
+  cel0_Pool* pool = worker->pool;
+  pthread_mutex_lock(&worker->lock);
+  if (worker->begin < worker->end) worker->chunk = worker->begin++;
+  pthread_mutex_unlock(&worker->lock);
+  /* Steals half of the chunks left to the first worker that has some. */
+  for (int i=1; i<pool->size && worker->chunk < 0; i++) {
+    cel0_Worker* victim = pool->workers + (worker - pool->workers + i) % pool->size;
+    pthread_mutex_lock(&victim->lock);
+    int stolen = (victim->end - victim->begin + 1) / 2;
+    victim->end -= stolen;
+    int begin = victim->end;
+    pthread_mutex_unlock(&victim->lock);
+    if (!stolen) continue;
+    pthread_mutex_lock(&worker->lock);
+    worker->chunk = begin;
+    worker->begin = begin + 1;
+    worker->end = begin + stolen;
+    pthread_mutex_unlock(&worker->lock);
+  }
+  if (worker->chunk < 0) return 0;
+  worker->next = worker->chunk * job->chunk_size;
+  return 1;
+}
+
+/* Evaluates chunks until none is left. */
+static void workOnJob(cel0_Worker* worker, cel0_ParallelJob* job) {
+  for (;;) {
+    if (worker->chunk < 0 && !takeChunk(worker, job)) return;
+    int end = jobChunkEnd(job, worker->chunk);
+    for (; worker->next < end; worker->next++) {
+      lockContext();
+      char needed = isJobElementNeeded(job, worker->chunk, worker->next);
+      unlockContext();
+      if (!needed) break;
+      evaluateJobElement(job, worker->chunk, worker->next);
+    }
+    worker->chunk = -1;
+  }
+}
+
+static void* runWorker(void* argument) {
+  cel0_Worker* worker = argument;
+  cel0_Pool* pool = worker->pool;
+  enterContext(pool->context);
+  g_roots = &worker->roots;
+  int round = 0;
+  pthread_mutex_lock(&pool->lock);
+  for (;;) {
+    while (pool->round == round && !pool->shutdown)
+      pthread_cond_wait(&pool->start, &pool->lock);
+    if (pool->shutdown) break;
+    round = pool->round;
+    pthread_mutex_unlock(&pool->lock);
+    workOnJob(worker, pool->job);
+    pthread_mutex_lock(&pool->lock);
+    pool->running--;
+    pthread_cond_broadcast(&pool->changed);
+  }
+  pthread_mutex_unlock(&pool->lock);
+  return 0;
+}
+
+/* One worker per processor, or CEL0_THREADS. With a single worker, jobs
+   run on the calling thread and no thread is started. */
+static cel0_Pool* createPool() {
+  cel0_Pool* pool = calloc(1, sizeof(cel0_Pool));
+  assert(pool);
+  pool->context = g_context;
+  char* threads = getenv("CEL0_THREADS");
+  pool->size = threads ? atoi(threads) : sysconf(_SC_NPROCESSORS_ONLN);
+  if (pool->size < 1) pool->size = 1;
+  if (pool->size > cel0_MaxWorkers) pool->size = cel0_MaxWorkers;
+  if (pool->size == 1) return pool;
+
+  pthread_mutex_init(&pool->lock, 0);
+  pthread_cond_init(&pool->start, 0);
+  pthread_cond_init(&pool->changed, 0);
+  pthread_cond_init(&pool->resumed, 0);
+  pool->workers = calloc(pool->size, sizeof(cel0_Worker));
+  assert(pool->workers);
+  for (int i=0; i<pool->size; i++) {
+    cel0_Worker* worker = pool->workers + i;
+    worker->pool = pool;
+    worker->chunk = -1;
+    pthread_mutex_init(&worker->lock, 0);
+    int created = pthread_create(&worker->thread, 0, runWorker, worker);
+    assert(created == 0);
+    (void)created;
+  }
+  return pool;
+}
+
+static void destroyPool(cel0_Pool* pool) {
+  if (pool->size > 1) {
+    pthread_mutex_lock(&pool->lock);
+    pool->shutdown = 1;
+    pthread_cond_broadcast(&pool->start);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i=0; i<pool->size; i++) {
+      pthread_join(pool->workers[i].thread, 0);
+      pthread_mutex_destroy(&pool->workers[i].lock);
+      free(pool->workers[i].roots.pinned);
+    }
+    free(pool->workers);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->start);
+    pthread_cond_destroy(&pool->changed);
+    pthread_cond_destroy(&pool->resumed);
+  }
+  free(pool);
+}
+
+/* Jobs of natives called by workers run on the worker's thread. */
+static char canRunInParallel() {
+  if (g_context->profile) return 0;
+  if (!g_context->pool) g_context->pool = createPool();
+  return !g_context->parallel && g_context->pool->size > 1;
+}
+
+static void runJob(cel0_ParallelJob* job) {
+  cel0_Context* context = g_context;
+  if (!canRunInParallel() || job->chunk_count == 1) {
+    runJobSequentially(job);
+    return;
+  }
+  cel0_Pool* pool = context->pool;
+
+  for (int i=0; i<pool->size; i++) {
+    cel0_Worker* worker = pool->workers + i;
+    worker->begin = job->chunk_count * i / pool->size;
+    worker->end = job->chunk_count * (i + 1) / pool->size;
+    worker->chunk = -1;
+  }
+  pool->job = job;
+  context->parallel = 1;
+  pthread_mutex_lock(&pool->lock);
+  pool->running = pool->size;
+  pool->round++;
+  pthread_cond_broadcast(&pool->start);
+  while (pool->running) pthread_cond_wait(&pool->changed, &pool->lock);
+  pthread_mutex_unlock(&pool->lock);
+  context->parallel = 0;
+}
+
+static cel0_ParallelJob createJob(int kind, cel0_Value function, cel0_Value* elements, int size) {
+  cel0_ParallelJob job = { .kind = kind, .function = function, .elements = elements, .size = size };
+  job.chunk_size = (job.size + cel0_ParallelChunks - 1) / cel0_ParallelChunks;
+  if (job.chunk_size < 1) job.chunk_size = 1;
+  job.chunk_count = (job.size + job.chunk_size - 1) / job.chunk_size;
+  job.panic_index = kind == cel0_JobKind_Reduce ? job.chunk_count : job.size;
+  return job;
+}
+
+/* Replaces each of the count closures, which are rooted, with the result
+   of applying it as self to no arguments. Returns the index of the first
+   result that is a panic, -1 if none. */
+static int applyClosures(cel0_Value* closures, int count, cel0_Value self) {
+  cel0_ParallelJob job = createJob(cel0_JobKind_Call, self, closures, count);
+  job.results = closures;
+  runJob(&job);
+  return job.panic_index < count ? job.panic_index : -1;
+}
+
+/* Results and panics are those of applying function to the elements in
+   order: the panic returned is the one of the lowest element. */
+static cel0_Value pmap(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  if (argument_count != 2) return *createPanicValue("ill-formed");
+  if (arguments[0].type != cel0_ValueType_Vector || !closureFunction(arguments[0], stack))
+    return *createPanicValue("param-type-1");
+  if (arguments[1].type != cel0_ValueType_Vector) return *createPanicValue("param-type-2");
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(arguments[1].u.vector_id);
+  cel0_ParallelJob job = createJob(cel0_JobKind_Map, arguments[0], metadata->vector, metadata->size);
+
+  cel0_Value result = *createVectorValueWithSize(cel0_ValueType_Vector, job.size);
+  job.results = lookupVectorMetadata(result.u.vector_id)->vector;
+  clearRegisters(job.results, 0, job.size);
+  pinValue(result);
+  runJob(&job);
+  unpinValue();
+  return job.panic_index < job.size ? job.results[job.panic_index] : result;
+}
+
+/* Folds function, which must be associative, over the elements starting
+   from init. Each chunk is folded from its first element, then the chunk
+   results are folded in order into init. */
+static cel0_Value preduce(cel0_Value* arguments, int argument_count, cel0_SymbolBindingStack* stack) {
+  if (argument_count != 3) return *createPanicValue("ill-formed");
+  if (arguments[0].type != cel0_ValueType_Vector || !closureFunction(arguments[0], stack))
+    return *createPanicValue("param-type-1");
+  if (arguments[2].type != cel0_ValueType_Vector) return *createPanicValue("param-type-3");
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(arguments[2].u.vector_id);
+  cel0_ParallelJob job = createJob(cel0_JobKind_Reduce, arguments[0], metadata->vector, metadata->size);
+  if (job.size == 0) return arguments[1];
+
+  cel0_Value accumulators = *createVectorValueWithSize(cel0_ValueType_Vector, job.chunk_count);
+  job.results = lookupVectorMetadata(accumulators.u.vector_id)->vector;
+  clearRegisters(job.results, 0, job.chunk_count);
+  pinValue(accumulators);
+  runJob(&job);
+  for (int chunk=0; chunk<job.chunk_count && job.panic_index == job.chunk_count; chunk++) {
+    cel0_Value pair[2] = { chunk ? job.results[chunk - 1] : arguments[1], job.results[chunk] };
+    job.results[chunk] = applyClosure(job.function, pair, 2);
+    if (job.results[chunk].type == cel0_ValueType_Panic) job.panic_index = chunk;
+  }
+  unpinValue();
+  return job.results[job.panic_index < job.chunk_count ? job.panic_index : job.chunk_count - 1];
 }
 
 #define cel0_SymbolBindingFrameCapacity 1<<20
 
-cel0_Value* cel0_eval(cel0_Value* value) {
+/* The globals are built once and shared by every program evaluated. */
+static cel0_SymbolBindingStack* globalBindings() {
+  cel0_SymbolBindingStack* stack = &g_context->global_bindings;
+  if (stack->frames) return stack;
   int capacity = cel0_SymbolBindingFrameCapacity;
   cel0_SymbolBinding* frames = malloc(sizeof(cel0_SymbolBinding)*capacity);
+  assert(frames);
 
   int size = 0;
   int transform = cel0_SymbolBindingType_TransformNative;
   int native = cel0_SymbolBindingType_Native;  
 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = transform, .symbol = createSymbolValue("bind"), .u = {.native  = { bind, bindCaptureLexicalBindings}}};
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("bind")), .u = {.transform  = { compileBind, bindCaptureLexicalBindings}}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = transform, .symbol = createSymbolValue("lambda"), .u = {.native = { lambda, lambdaCaptureLexicalBindings }}};
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("pbind")), .u = {.transform  = { compileParallelBind, bindCaptureLexicalBindings}}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = transform, .symbol = createSymbolValue("if"), .u = {.native = { ifStatement, ifCaptureLexicalBindings } }}; 
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("lambda")), .u = {.transform = { compileLambda, lambdaCaptureLexicalBindings }}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = transform, .symbol = createSymbolValue("quote"), .u = {.native =  { quote, quoteCaptureLexicalBindings }}};
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("memo-lambda")), .u = {.transform = { compileMemoLambda, memoLambdaCaptureLexicalBindings }}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("add"), .u = {.native = {add}}}; 
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("if")), .u = {.transform = { compileIf, ifCaptureLexicalBindings } }}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("mul"), .u = {.native = {mul}}}; 
+    { .type = transform, .symbol = createPermanentValue(createSymbolValue("quote")), .u = {.transform =  { compileQuote, quoteCaptureLexicalBindings }}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("eq"), .u = {.native = {eq}}};
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("add")), .u = {.native = {add}}}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("length"), .u = {.native = {length}}}; 
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("mul")), .u = {.native = {mul}}}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("append"), .u = {.native = {append}}}; 
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("eq")), .u = {.native = {eq}}};
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("nth"), .u = {.native = {nth}}}; 
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("length")), .u = {.native = {length}}}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("open-file!"), .u = {.native = {open_file}}}; 
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("append")), .u = {.native = {append}}}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("dp!"), .u = {.native = {debug_print}}}; 
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("nth")), .u = {.native = {nth}}}; 
   frames[size++] = (cel0_SymbolBinding)
-    { .type = native, .symbol = createSymbolValue("vec"), .u = {.native = {vector}}}; 
-  
-  cel0_SymbolBindingStack stack = {.frames = frames, .global_size = size, .begin = size, .size = size, .capacity = capacity };
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("open-file!")), .u = {.native = {open_file}}}; 
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("dp!")), .u = {.native = {debug_print}}}; 
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vec")), .u = {.native = {vector}}}; 
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("pmap")), .u = {.native = {pmap}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("preduce")), .u = {.native = {preduce}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("mem-stats!")), .u = {.native = {mem_stats}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vsum")), .u = {.native = {vector_sum}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vmin")), .u = {.native = {vector_min}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vmax")), .u = {.native = {vector_max}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("index-of")), .u = {.native = {index_of}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vcount")), .u = {.native = {vector_count}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vadd")), .u = {.native = {vector_add}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("vmul")), .u = {.native = {vector_mul}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("range")), .u = {.native = {range}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("slice")), .u = {.native = {slice}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("concat")), .u = {.native = {concat}}};
+  frames[size++] = (cel0_SymbolBinding)
+    { .type = native, .symbol = createPermanentValue(createSymbolValue("sort")), .u = {.native = {sort}}};
   
-  stack.frames = frames;
-  return eval(value, &stack);
+  *stack = (cel0_SymbolBindingStack) {.frames = frames, .global_size = size, .begin = size, .size = size, .capacity = capacity };
+  for (int i=0; i<size; i++)
+    linkSymbolBinding(stack, i);
+  return stack;
+}
+
+static cel0_Code* compileProgram(cel0_Value* value) {
+  cel0_SymbolBindingStack* stack = globalBindings();
+  assert(stack->size == stack->global_size);
+  cel0_Compiler compiler = { .code = createCode(), .stack = stack, .next_register = 0, .tail_register = -1 };
+  int result = allocateRegister(&compiler);
+  compileExpression(&compiler, value, result);
+  emit(compiler.code, cel0_OpCode_Return);
+  emit(compiler.code, result);
+  return compiler.code;
+}
+
+/* form, if not 0, holds the code compiled to C for each code object the
+   compilation of value makes. */
+/* Compiled code is only installed for codes it was emitted from, as far
+   as their number and sizes tell; otherwise returns 0 without running. */
+static cel0_Value* evaluate(cel0_Context* context, cel0_Value* value, const cel0_CompiledForm* form) {
+  cel0_Context* previous = enterContext(context);
+  int codes_size = g_context->codes_size;
+  cel0_Code* code = compileProgram(value);
+  if (form) {
+    char matches = form->codes_size == g_context->codes_size - codes_size;
+    for (int i=0; matches && i<form->codes_size; i++)
+      matches = form->instructions_sizes[i] == g_context->codes[codes_size + i]->instructions_size;
+    if (!matches) {
+      releaseCodes(codes_size);
+      enterContext(previous);
+      return 0;
+    }
+    for (int i=0; i<form->codes_size; i++)
+      g_context->codes[codes_size + i]->compiled = form->codes[i];
+  }
+
+  cel0_Machine machine = { .stack = globalBindings(), .caller = context->roots.machine };
+  cel0_Value no_closure = { .type = cel0_ValueType_Number };
+  pushFrame(&machine, code, 0, no_closure);
+  clearRegisters(machine.registers, 0, code->register_count);
+  context->roots.machine = &machine;
+  cel0_Value evaluated = runTop(&machine);
+  context->roots.machine = machine.caller;
+  free(machine.registers);
+  free(machine.frames);
+  releaseCodes(codes_size);
+  context->result = evaluated;
+  enterContext(previous);
+  return &context->result;
+}
+
+cel0_Value* cel0_eval(cel0_Context* context, cel0_Value* value) {
+  return evaluate(context, value, 0);
+}
+
+int cel0_runCompiled(const char* source, const cel0_CompiledForm* forms, int forms_size) {
+  cel0_Context* context = cel0_createContext();
+  FILE* in = fmemopen((char*)source, strlen(source) + 1, "r");
+  assert(in);
+  cel0_Reader* reader = cel0_createReader(context, in);
+  cel0_Value* parsed;
+  int i = 0;
+  for (; (parsed = cel0_read(reader)); i++) {
+    cel0_Value* evaluated = i >= forms_size ? 0 :
+      parsed->type == cel0_ValueType_Panic ? parsed : evaluate(context, parsed, forms + i);
+    if (!evaluated) break;
+    cel0_printValue(context, evaluated, stdout);
+    printf("\n");
+    fflush(stdout);
+  }
+  cel0_destroyReader(reader);
+  fclose(in);
+  cel0_destroyContext(context);
+  if (parsed || i != forms_size) {
+    fprintf(stderr, "compiled code does not match its program at form %d; emit it again with this runtime\n", i + 1);
+    return 1;
+  }
+  return 0;
+}
+
+static int instructionLength(int op_code) {
+  switch (op_code) {
+  case cel0_OpCode_CallNative: return 5;
+  case cel0_OpCode_Call:
+  case cel0_OpCode_TailCall: return 6;
+  case cel0_OpCode_Jump:
+  case cel0_OpCode_Panic:
+  case cel0_OpCode_Return:
+  case cel0_OpCode_TestParallel: return 2;
+  default: return 3;
+  }
+}
+
+/* The C for a call to a native that panics, unwinding the frame. */
+static void emitNativeCall(FILE* out, int pc, int target) {
+  fprintf(out, "    cel0_safepoint();\n"
+	  "    value = cel0_callNative(machine, %d);\n"
+	  "    if (value.type == cel0_ValueType_Panic) return cel0_unwind(machine, %d, value);\n"
+	  "    registers[%d] = value;\n", pc, pc, target);
+}
+
+/* add and mul of numbers, and eq of values of the same type, are inlined,
+   with the native as the fallback that panics. */
+static void emitCallNative(FILE* out, int* instruction, int pc) {
+  cel0_SymbolBinding* binding = g_context->global_bindings.frames + instruction[2];
+  cel0_Value (*native)(cel0_Value*, int, cel0_SymbolBindingStack*) = binding->u.native.expression;
+  int target = instruction[1], base = instruction[3], count = instruction[4];
+  if (native == add || native == mul) {
+    fprintf(out, "  if (1");
+    for (int i=0; i<count; i++)
+      fprintf(out, " && registers[%d].type == cel0_ValueType_Number", base + i);
+    fprintf(out, ") {\n    registers[%d] = cel0_numberValue((int)(%s", target, native == add ? "0u" : "1u");
+    for (int i=0; i<count; i++)
+      fprintf(out, " %c (unsigned)registers[%d].u.number", native == add ? '+' : '*', base + i);
+    fprintf(out, "));\n  } else {\n");
+  } else if (native == eq && count == 2) {
+    fprintf(out, "  if (registers[%d].type == registers[%d].type && registers[%d].type != cel0_ValueType_Panic) {\n"
+	    "    registers[%d] = cel0_symbolValue(registers[%d].u.number == registers[%d].u.number ? %d : %d);\n"
+	    "  } else {\n", base, base + 1, base, target, base, base + 1, cel0_Symbol_True, cel0_Symbol_False);
+  } else {
+    fprintf(out, "  {\n");
+  }
+  emitNativeCall(out, pc, target);
+  fprintf(out, "  }\n");
+}
+
+static void emitInstruction(FILE* out, cel0_Code* code, int pc) {
+  int* instruction = code->instructions + pc;
+  switch (instruction[0]) {
+  case cel0_OpCode_LoadConstant:
+    if (code->constants[instruction[2]].type == cel0_ValueType_Number)
+      fprintf(out, "  registers[%d] = cel0_numberValue(%d);\n", instruction[1], code->constants[instruction[2]].u.number);
+    else
+      fprintf(out, "  registers[%d] = constants[%d];\n", instruction[1], instruction[2]);
+    break;
+  case cel0_OpCode_Move:
+    fprintf(out, "  registers[%d] = registers[%d];\n", instruction[1], instruction[2]);
+    break;
+  case cel0_OpCode_LoadNativeName:
+    fprintf(out, "  cel0_safepoint();\n  registers[%d] = cel0_loadNativeName(machine, %d);\n", instruction[1], pc);
+    break;
+  case cel0_OpCode_CallNative:
+    emitCallNative(out, instruction, pc);
+    break;
+  case cel0_OpCode_Call:
+  case cel0_OpCode_TailCall:
+    fprintf(out, "  cel0_safepoint();\n  value = cel0_%s(machine, %d);\n", instruction[0] == cel0_OpCode_Call ? "call" : "tailCall", pc);
+    if (instruction[0] == cel0_OpCode_TailCall)
+      fprintf(out, "  if (value.type == cel0_ValueType_TailCall) return value;\n");
+    fprintf(out, "  if (value.type == cel0_ValueType_Panic) return cel0_unwind(machine, %d, value);\n"
+	    "  registers = cel0_registers(machine);\n"
+	    "  registers[%d] = value;\n", pc, instruction[1]);
+    break;
+  case cel0_OpCode_Test:
+    fprintf(out, "  if (registers[%d].type != cel0_ValueType_Symbol) return cel0_panic(machine, %d);\n"
+	    "  if (registers[%d].u.symbol_id != %d) {\n"
+	    "    assert(registers[%d].u.symbol_id == %d);\n"
+	    "    goto pc_%d;\n"
+	    "  }\n", instruction[1], pc, instruction[1], cel0_Symbol_True, instruction[1], cel0_Symbol_False, instruction[2]);
+    break;
+  case cel0_OpCode_Jump:
+    fprintf(out, "  goto pc_%d;\n", instruction[1]);
+    break;
+  case cel0_OpCode_MakeClosure:
+    fprintf(out, "  cel0_safepoint();\n  registers[%d] = cel0_makeClosure(machine, %d);\n", instruction[1], pc);
+    break;
+  case cel0_OpCode_Panic:
+    fprintf(out, "  return cel0_panic(machine, %d);\n", pc);
+    break;
+  case cel0_OpCode_Return:
+    fprintf(out, "  return cel0_return(machine, registers[%d]);\n", instruction[1]);
+    break;
+  case cel0_OpCode_TestParallel:
+    fprintf(out, "  if (!cel0_testParallel()) goto pc_%d;\n", instruction[1]);
+    break;
+  case cel0_OpCode_ParallelCall:
+    fprintf(out, "  cel0_safepoint();\n  value = cel0_parallelCall(machine, %d);\n"
+	    "  if (value.type == cel0_ValueType_Panic) return cel0_unwind(machine, %d, value);\n", pc, pc);
+    break;
+  default:
+    assert(0);
+  }
+}
+
+/* Each instruction becomes the C that run executes for it, with branches
+   as gotos between the instructions jumped to. */
+static void emitCode(FILE* out, cel0_Code* code, int form, int index) {
+  char* targets = calloc(code->instructions_size + 1, 1);
+  assert(targets);
+  for (int pc=0; pc<code->instructions_size; pc+=instructionLength(code->instructions[pc])) {
+    int* instruction = code->instructions + pc;
+    if (instruction[0] == cel0_OpCode_Test) targets[instruction[2]] = 1;
+    if (instruction[0] == cel0_OpCode_Jump || instruction[0] == cel0_OpCode_TestParallel) targets[instruction[1]] = 1;
+  }
+  fprintf(out, "static cel0_Value cel0_code_%d_%d(struct cel0_Machine* machine, const cel0_Value* constants) {\n"
+	  "  cel0_Value* registers = cel0_registers(machine);\n"
+	  "  cel0_Value value;\n"
+	  "  (void)constants;\n"
+	  "  (void)value;\n", form, index);
+  for (int pc=0; pc<code->instructions_size; pc+=instructionLength(code->instructions[pc])) {
+    if (targets[pc]) fprintf(out, " pc_%d:\n", pc);
+    emitInstruction(out, code, pc);
+  }
+  fprintf(out, "}\n\n");
+  free(targets);
+}
+
+void cel0_emitC(cel0_Context* context, FILE* in, FILE* out) {
+  cel0_Context* previous = enterContext(context);
+  char* source = 0;
+  int source_size = 0, source_capacity = 0;
+  for (int c; (c = fgetc(in)) != EOF;) {
+    source = growBuffer(source, &source_capacity, source_size + 2, 1);
+    source[source_size++] = c;
+  }
+  source = growBuffer(source, &source_capacity, source_size + 1, 1);
+  source[source_size] = 0;
+
+  fprintf(out, "#include \"cel0.h\"\n\n"
+	  "static inline cel0_Value cel0_numberValue(int number) {\n"
+	  "  return (cel0_Value) { .type = cel0_ValueType_Number, .u = { .number = number } };\n"
+	  "}\n\n"
+	  "static inline cel0_Value cel0_symbolValue(int symbol_id) {\n"
+	  "  return (cel0_Value) { .type = cel0_ValueType_Symbol, .u = { .symbol_id = symbol_id } };\n"
+	  "}\n\n");
+  FILE* source_file = fmemopen(source, source_size + 1, "r");
+  assert(source_file);
+  cel0_Reader* reader = cel0_createReader(context, source_file);
+  cel0_Value* parsed;
+  int forms_size = 0;
+  for (; (parsed = cel0_read(reader)); forms_size++) {
+    if (parsed->type == cel0_ValueType_Panic) {
+      fprintf(out, "#define cel0_form_%d { 0, 0, 0 }\n\n", forms_size);
+      continue;
+    }
+    enterContext(context);
+    int codes_size = g_context->codes_size;
+    compileProgram(parsed);
+    for (int i=codes_size; i<g_context->codes_size; i++)
+      emitCode(out, g_context->codes[i], forms_size, i - codes_size);
+    int form_codes_size = g_context->codes_size - codes_size;
+    fprintf(out, "static const cel0_CompiledCode cel0_form_%d_codes[] = {", forms_size);
+    for (int i=0; i<form_codes_size; i++)
+      fprintf(out, "%s cel0_code_%d_%d", i ? "," : "", forms_size, i);
+    fprintf(out, " };\nstatic const int cel0_form_%d_instructions_sizes[] = {", forms_size);
+    for (int i=codes_size; i<g_context->codes_size; i++)
+      fprintf(out, "%s %d", i > codes_size ? "," : "", g_context->codes[i]->instructions_size);
+    fprintf(out, " };\n#define cel0_form_%d { %d, cel0_form_%d_codes, cel0_form_%d_instructions_sizes }\n\n",
+	    forms_size, form_codes_size, forms_size, forms_size);
+    releaseCodes(codes_size);
+  }
+  cel0_destroyReader(reader);
+  fclose(source_file);
+
+  /* Bytes rather than a string literal, which compilers may limit. */
+  fprintf(out, "static const char cel0_source[] = {");
+  for (int i=0; i<=source_size; i++)
+    fprintf(out, "%s%d,", i % 20 ? " " : "\n  ", (unsigned char)source[i]);
+  fprintf(out, "\n};\n\nstatic const cel0_CompiledForm cel0_forms[] = {");
+  for (int i=0; i<forms_size; i++)
+    fprintf(out, "%s cel0_form_%d", i ? "," : "", i);
+  fprintf(out, " };\n\nint main(void) {\n"
+	  "  return cel0_runCompiled(cel0_source, cel0_forms, %d);\n}\n", forms_size);
+  free(source);
+  enterContext(previous);
+}
+
+/* An image holds the forms of a program as they are parsed. Symbol and
+   vector ids are relative to the image, so it can be mapped anywhere and
+   loaded without scanning any text. The elements of a vector only refer
+   to vectors after it, so forms are trees.
+
+   Layout: header, symbol name offsets, vectors, values, forms, names. */
+#define cel0_ImageMagic "cel0img"
+#define cel0_ImageVersion 1
+typedef struct cel0_ImageHeader {
+  char magic[8];
+  int version;
+  int symbols_size;
+  int vectors_size;
+  int values_size;
+  int forms_size;
+  int names_size;
+} cel0_ImageHeader;
+
+typedef struct cel0_ImageVector {
+  /* Index of the first element in the values. */
+  int begin;
+  int size;
+} cel0_ImageVector;
+
+typedef struct cel0_ImageWriter {
+  int* symbols;
+  int symbols_size;
+  int* symbol_ids;
+  int symbol_ids_capacity;
+  cel0_ImageVector* vectors;
+  int vectors_size;
+  int vectors_capacity;
+  cel0_Value* values;
+  int values_size;
+  int values_capacity;
+} cel0_ImageWriter;
+
+static cel0_Value imageValue(cel0_ImageWriter* writer, cel0_Value* value) {
+  if (value->type == cel0_ValueType_Number) return *value;
+  if (value->type == cel0_ValueType_Symbol) {
+    int* image_id = writer->symbols + value->u.symbol_id;
+    if (*image_id < 0) {
+      writer->symbol_ids = growBuffer(writer->symbol_ids, &writer->symbol_ids_capacity, writer->symbols_size + 1, sizeof(int));
+      writer->symbol_ids[writer->symbols_size] = value->u.symbol_id;
+      *image_id = writer->symbols_size++;
+    }
+    return symbolValue(*image_id);
+  }
+
+  cel0_VectorMetadata* metadata = lookupVectorMetadata(value->u.vector_id);
+  int vector = writer->vectors_size++;
+  writer->vectors = growBuffer(writer->vectors, &writer->vectors_capacity, writer->vectors_size, sizeof(cel0_ImageVector));
+  int begin = writer->values_size;
+  writer->values_size += metadata->size;
+  writer->values = growBuffer(writer->values, &writer->values_capacity, writer->values_size, sizeof(cel0_Value));
+  writer->vectors[vector] = (cel0_ImageVector) { .begin = begin, .size = metadata->size };
+  for (int i=0; i<metadata->size; i++) {
+    cel0_Value element = imageValue(writer, metadata->vector + i);
+    writer->values[begin + i] = element;
+  }
+  return (cel0_Value) { .type = value->type, .u = { .vector_id = vector } };
+}
+
+int cel0_writeImage(cel0_Reader* reader, FILE* out) {
+  cel0_Context* previous = enterContext(reader->context);
+  cel0_ImageWriter writer = { 0 };
+  cel0_Value* forms = 0;
+  int forms_size = 0, forms_capacity = 0;
+  cel0_Value* parsed;
+  while ((parsed = cel0_read(reader))) {
+    forms = growBuffer(forms, &forms_capacity, forms_size + 1, sizeof(cel0_Value));
+    forms[forms_size++] = *parsed;
+  }
+  writer.symbols = malloc((g_context->symbol_number + 1) * sizeof(int));
+  assert(writer.symbols);
+  for (int i=0; i<g_context->symbol_number; i++)
+    writer.symbols[i] = -1;
+  for (int i=0; i<forms_size; i++)
+    forms[i] = imageValue(&writer, forms + i);
+
+  cel0_ImageHeader header = { .magic = cel0_ImageMagic, .version = cel0_ImageVersion, .symbols_size = writer.symbols_size,
+			      .vectors_size = writer.vectors_size, .values_size = writer.values_size, .forms_size = forms_size };
+  for (int i=0; i<writer.symbols_size; i++)
+    header.names_size += g_context->symbol_lengths[writer.symbol_ids[i]] + 1;
+  fwrite(&header, sizeof(header), 1, out);
+  for (int i=0, offset=0; i<writer.symbols_size; i++) {
+    fwrite(&offset, sizeof(int), 1, out);
+    offset += g_context->symbol_lengths[writer.symbol_ids[i]] + 1;
+  }
+  if (writer.vectors_size) fwrite(writer.vectors, sizeof(cel0_ImageVector), writer.vectors_size, out);
+  if (writer.values_size) fwrite(writer.values, sizeof(cel0_Value), writer.values_size, out);
+  if (forms_size) fwrite(forms, sizeof(cel0_Value), forms_size, out);
+  for (int i=0; i<writer.symbols_size; i++)
+    fwrite(g_context->symbol_names[writer.symbol_ids[i]], 1, g_context->symbol_lengths[writer.symbol_ids[i]] + 1, out);
+
+  free(writer.symbols);
+  free(writer.symbol_ids);
+  free(writer.vectors);
+  free(writer.values);
+  free(forms);
+  enterContext(previous);
+  return ferror(out) ? -1 : 0;
+}
+
+struct cel0_Image {
+  cel0_Context* context;
+  void* mapping;
+  size_t mapping_size;
+  const cel0_ImageHeader* header;
+  const cel0_ImageVector* vectors;
+  const cel0_Value* values;
+  const cel0_Value* forms;
+  /* The context's id of each image symbol. */
+  int* symbols;
+  int next_form;
+};
+
+/* Whether a value of the image is well-formed where a vector with index
+   parent, or -1 for a form, holds it. As parsed, only a form can panic. */
+static char validImageValue(const cel0_ImageHeader* header, cel0_Value value, int parent) {
+  switch (value.type) {
+  case cel0_ValueType_Number: return 1;
+  case cel0_ValueType_Symbol: return value.u.symbol_id >= 0 && value.u.symbol_id < header->symbols_size;
+  case cel0_ValueType_Panic: if (parent >= 0) return 0; /* fallthrough */
+  case cel0_ValueType_Vector: return value.u.vector_id > parent && value.u.vector_id < header->vectors_size;
+  default: return 0;
+  }
+}
+
+static char validImage(cel0_Image* image, const int* name_offsets, const char* names) {
+  const cel0_ImageHeader* header = image->header;
+  for (int i=0; i<header->symbols_size; i++)
+    if (name_offsets[i] < 0 || name_offsets[i] >= header->names_size ||
+	!memchr(names + name_offsets[i], 0, header->names_size - name_offsets[i]))
+      return 0;
+  for (int i=0; i<header->vectors_size; i++) {
+    cel0_ImageVector vector = image->vectors[i];
+    if (vector.begin < 0 || vector.size < 0 || vector.begin > header->values_size - vector.size) return 0;
+    for (int j=0; j<vector.size; j++)
+      if (!validImageValue(header, image->values[vector.begin + j], i)) return 0;
+  }
+  for (int i=0; i<header->forms_size; i++)
+    if (!validImageValue(header, image->forms[i], -1)) return 0;
+  return 1;
+}
+
+cel0_Image* cel0_openImage(cel0_Context* context, const char* path) {
+  int fd = open(path, O_RDONLY);
+  if (fd < 0) return 0;
+  struct stat st;
+  void* mapping = MAP_FAILED;
+  if (fstat(fd, &st) == 0 && (size_t)st.st_size >= sizeof(cel0_ImageHeader))
+    mapping = mmap(0, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+  close(fd);
+  if (mapping == MAP_FAILED) return 0;
+
+  cel0_Image* image = calloc(1, sizeof(cel0_Image));
+  assert(image);
+  image->context = context;
+  image->mapping = mapping;
+  image->mapping_size = st.st_size;
+  const cel0_ImageHeader* header = image->header = mapping;
+  char sizes_valid = memcmp(header->magic, cel0_ImageMagic, sizeof(header->magic)) == 0 &&
+    header->version == cel0_ImageVersion && header->symbols_size >= 0 && header->vectors_size >= 0 &&
+    header->values_size >= 0 && header->forms_size >= 0 && header->names_size >= 0;
+  /* Sizes are ints, so the sum cannot overflow. */
+  size_t size = sizeof(cel0_ImageHeader) + (size_t)header->symbols_size * sizeof(int) +
+    (size_t)header->vectors_size * sizeof(cel0_ImageVector) +
+    ((size_t)header->values_size + header->forms_size) * sizeof(cel0_Value) + header->names_size;
+  if (!sizes_valid || size != image->mapping_size) {
+    cel0_closeImage(image);
+    return 0;
+  }
+  const int* name_offsets = (const int*)(header + 1);
+  image->vectors = (const cel0_ImageVector*)(name_offsets + header->symbols_size);
+  image->values = (const cel0_Value*)(image->vectors + header->vectors_size);
+  image->forms = image->values + header->values_size;
+  const char* names = (const char*)(image->forms + header->forms_size);
+  if (!validImage(image, name_offsets, names)) {
+    cel0_closeImage(image);
+    return 0;
+  }
+
+  cel0_Context* previous = enterContext(context);
+  image->symbols = malloc((header->symbols_size + 1) * sizeof(int));
+  assert(image->symbols);
+  for (int i=0; i<header->symbols_size; i++)
+    image->symbols[i] = internSymbol((char*)names + name_offsets[i]);
+  enterContext(previous);
+  return image;
+}
+
+void cel0_closeImage(cel0_Image* image) {
+  munmap(image->mapping, image->mapping_size);
+  free(image->symbols);
+  free(image);
+}
+
+static cel0_Value loadImageValue(cel0_Image* image, cel0_Value value) {
+  if (value.type == cel0_ValueType_Number) return value;
+  if (value.type == cel0_ValueType_Symbol) return symbolValue(image->symbols[value.u.symbol_id]);
+  cel0_ImageVector vector = image->vectors[value.u.vector_id];
+  cel0_Value* loaded = createVectorValueWithSize(value.type, vector.size);
+  for (int i=0; i<vector.size; i++) {
+    cel0_Value element = loadImageValue(image, image->values[vector.begin + i]);
+    lookupVectorMetadata(loaded->u.vector_id)->vector[i] = element;
+  }
+  return *loaded;
+}
+
+cel0_Value* cel0_readImage(cel0_Image* image) {
+  if (image->next_form == image->header->forms_size) return 0;
+  cel0_Context* previous = enterContext(image->context);
+  cel0_Value* value = allocateValue();
+  *value = loadImageValue(image, image->forms[image->next_form++]);
+  enterContext(previous);
+  return value;
+}
+
+void cel0_startProfile(cel0_Context* context) {
+  if (context->profile) return;
+  context->profile = calloc(1, sizeof(cel0_Profile));
+  assert(context->profile);
+  context->profile->nodes = calloc(1, sizeof(cel0_ProfileNode));
+  assert(context->profile->nodes);
+  context->profile->nodes[0].name = cel0_ProfileAnonymous;
+  context->profile->nodes_size = context->profile->nodes_capacity = 1;
+}
+
+static char* profileName(int name) {
+  return name == cel0_ProfileAnonymous ? "(anonymous)" : lookupSymbolName(name);
+}
+
+/* Functions are sorted with their times alongside, as a comparator gets
+   no context to look them up in. */
+typedef struct cel0_ProfileRank {
+  int function;
+  long long exclusive_ns;
+} cel0_ProfileRank;
+
+static int compareProfileRanks(const void* a, const void* b) {
+  long long a_ns = ((cel0_ProfileRank*)a)->exclusive_ns;
+  long long b_ns = ((cel0_ProfileRank*)b)->exclusive_ns;
+  return a_ns < b_ns ? 1 : a_ns > b_ns ? -1 : 0;
+}
+
+/* One line per path of the tree, its names joined by ';' and followed by
+   its exclusive time in microseconds. */
+static void writeFoldedStacks(cel0_Profile* profile, int node, char** path, FILE* folded) {
+  for (int child = profile->nodes[node].first_child; child; child = profile->nodes[child].next_sibling) {
+    cel0_ProfileNode* child_node = profile->nodes + child;
+    path[child_node->depth - 1] = profileName(child_node->name);
+    for (int i=0; i<child_node->depth; i++)
+      fprintf(folded, "%s%s", i ? ";" : "", path[i]);
+    fprintf(folded, " %lld\n", child_node->exclusive_ns / 1000);
+    writeFoldedStacks(profile, child, path, folded);
+  }
+}
+
+void cel0_writeProfile(cel0_Context* context, FILE* table, FILE* folded) {
+  cel0_Profile* profile = context->profile;
+  if (!profile) return;
+  cel0_Context* previous = enterContext(context);
+  cel0_ProfileRank* order = malloc((profile->functions_capacity + 1) * sizeof(cel0_ProfileRank));
+  assert(order);
+  int order_size = 0;
+  for (int i=0; i<profile->functions_capacity; i++)
+    if (profile->functions[i].calls)
+      order[order_size++] = (cel0_ProfileRank){ i, profile->functions[i].exclusive_ns };
+  qsort(order, order_size, sizeof(cel0_ProfileRank), compareProfileRanks);
+  fprintf(table, "%12s %14s %14s %12s  %s\n", "calls", "inclusive ms", "exclusive ms", "allocations", "name");
+  for (int i=0; i<order_size; i++) {
+    cel0_ProfileFunction* function = profile->functions + order[i].function;
+    fprintf(table, "%12lld %14.3f %14.3f %12lld  %s\n", function->calls, function->inclusive_ns / 1e6,
+	    function->exclusive_ns / 1e6, function->allocations, profileName(order[i].function - 1));
+  }
+  free(order);
+
+  char* path[cel0_MaxProfileDepth];
+  writeFoldedStacks(profile, 0, path, folded);
+  enterContext(previous);
+}
+
+void cel0_printMemoryStats(cel0_Context* context, FILE* fd) {
+  cel0_Context* previous = enterContext(context);
+  cel0_Value stats = memoryStats();
+  printValue(&stats, fd);
+  fprintf(fd, "\n");
+  enterContext(previous);
+}
+
+long long cel0_allocations(cel0_Context* context) {
+  return context->allocations;
+}
+
+cel0_Context* cel0_createContext() {
+  cel0_Context* context = calloc(1, sizeof(cel0_Context));
+  assert(context);
+  context->vector_metadata = calloc(cel0_MaxVectorMetadataLength, sizeof(cel0_VectorMetadata));
+  assert(context->vector_metadata);
+  context->free_vector_metadata = -1;
+  context->collection_threshold = cel0_MinCollectionThreshold;
+  pthread_mutexattr_t attributes;
+  pthread_mutexattr_init(&attributes);
+  pthread_mutexattr_settype(&attributes, PTHREAD_MUTEX_RECURSIVE);
+  pthread_mutex_init(&context->lock, &attributes);
+  pthread_mutexattr_destroy(&attributes);
+  return context;
+}
+
+void cel0_destroyContext(cel0_Context* context) {
+  cel0_Context* previous = enterContext(context);
+  if (context->pool) destroyPool(context->pool);
+  if (context->profile) {
+    free(context->profile->nodes);
+    free(context->profile->functions);
+    free(context->profile->entries);
+    free(context->profile);
+  }
+  releaseCodes(0);
+  free(context->codes);
+  for (int i=0; i<context->vector_metadata_number; i++) {
+    cel0_VectorMetadata* metadata = context->vector_metadata + i;
+    if (metadata->mapping) unmapByteVector(metadata);
+    if (metadata->memo) freeMemoCache(metadata->memo);
+    releaseVectorBuffer(metadata);
+  }
+  free(context->vector_metadata);
+  while (context->value_chunks) {
+    cel0_ValueChunk* next = context->value_chunks->next;
+    free(context->value_chunks);
+    context->value_chunks = next;
+  }
+  while (context->symbol_arena) {
+    cel0_SymbolArena* previous_arena = context->symbol_arena->previous;
+    free(context->symbol_arena);
+    context->symbol_arena = previous_arena;
+  }
+  free(context->symbol_names);
+  free(context->symbol_lengths);
+  free(context->symbol_hashes);
+  free(context->symbol_table);
+  free(context->mark_stack);
+  cel0_SymbolBindingStack* stack = &context->global_bindings;
+  for (int i=0; i<stack->global_size; i++)
+    free(stack->frames[i].symbol);
+  free(stack->frames);
+  free(stack->innermost);
+  free(context->place_holder_for_recursion);
+  free(context->roots.pinned);
+  pthread_mutex_destroy(&context->lock);
+  free(context);
+  enterContext(previous);
 }
@@ -21,15 +21,23 @@ static_assert(sizeof(cel0_Value) == 8, "cel0_Value should be 64 bits");
 #define cel0_SymbolBindingType_TransformNative 2
 
 struct cel0_SymbolBindingStack;
+struct cel0_Compiler;
 typedef struct cel0_SymbolBinding {
   int type;
   cel0_Value* symbol;
+  /* Index + 1 of the binding of the same symbol this one shadows, 0 if none. */
+  int shadowed;
+  /* The value of a local binding when the compiler knows it, else 0. */
+  cel0_Value* constant;
   union {
     cel0_Value* expression;
     struct {
-      cel0_Value* (*expression)(cel0_Value* parameters, struct cel0_SymbolBindingStack* stack);
-      cel0_Value* (*captureLexicalBindings)(cel0_Value* parameters, struct cel0_SymbolBindingStack* stack);
+      cel0_Value (*expression)(cel0_Value* arguments, int argument_count, struct cel0_SymbolBindingStack* stack);
     } native;
+    struct {
+      void (*compile)(struct cel0_Compiler* compiler, cel0_Value* form, int target);
+      cel0_Value* (*captureLexicalBindings)(cel0_Value* parameters, struct cel0_SymbolBindingStack* stack);
+    } transform;
   } u;
 } cel0_SymbolBinding;
 
@@ -40,10 +48,88 @@ typedef struct cel0_SymbolBindingStack {
   int begin;
   int size;
   int capacity;
+  /* Index + 1 of the innermost binding of each symbol id, 0 if unbound. */
+  int* innermost;
+  int innermost_capacity;
 } cel0_SymbolBindingStack;
 
-cel0_Value* cel0_parse(char* code);
+typedef struct cel0_Context cel0_Context;
+/* A context owns all interpreter state. Contexts are independent, so
+   different threads can each use their own at the same time. */
+cel0_Context* cel0_createContext();
+void cel0_destroyContext(cel0_Context* context);
+/* The number of values and vectors the context has allocated. */
+long long cel0_allocations(cel0_Context* context);
+/* Prints what (mem-stats!) returns. */
+void cel0_printMemoryStats(cel0_Context* context, FILE* fd);
+
+/* Profiling records the calls of closures and natives from then on, and
+   evaluates everything on the calling thread. The table holds the calls,
+   inclusive and exclusive time, and allocations of each name, the folded
+   stacks the exclusive time of each call path, for flame graph tools. */
+void cel0_startProfile(cel0_Context* context);
+void cel0_writeProfile(cel0_Context* context, FILE* table, FILE* folded);
+
+cel0_Value* cel0_parse(cel0_Context* context, char* code);
+
+typedef struct cel0_Reader cel0_Reader;
+cel0_Reader* cel0_createReader(cel0_Context* context, FILE* file);
+/* Returns the next top-level form of the input, or 0 at its end. */
+cel0_Value* cel0_read(cel0_Reader* reader);
+void cel0_destroyReader(cel0_Reader* reader);
+
+/* Writes the forms of reader's input as an image, which loads without
+   parsing. Returns 0 on success. */
+int cel0_writeImage(cel0_Reader* reader, FILE* out);
+typedef struct cel0_Image cel0_Image;
+/* Maps the image at path, or returns 0 if it cannot or it is invalid. The
+   image stays mapped until it is closed. */
+cel0_Image* cel0_openImage(cel0_Context* context, const char* path);
+/* Returns the next form of the image, like cel0_read. */
+cel0_Value* cel0_readImage(cel0_Image* image);
+void cel0_closeImage(cel0_Image* image);
+
+void cel0_printValue(cel0_Context* context, cel0_Value* value, FILE* fd);
+
+/* The result, and the vectors it refers to, stay valid until the next call. */
+cel0_Value* cel0_eval(cel0_Context* context, cel0_Value* value);
+
+/* Writes a C translation unit that evaluates the program read from in
+   and prints each result, as cel0 does, with the code of its lambdas and
+   forms compiled to C functions. Link it with this runtime. */
+void cel0_emitC(cel0_Context* context, FILE* in, FILE* out);
+
+/* What the emitted C hands the runtime. Each code object the compiler
+   makes for a form, in order, becomes a function that runs the frame on
+   top of machine until it returns, and then pops it. */
+struct cel0_Machine;
+typedef cel0_Value (*cel0_CompiledCode)(struct cel0_Machine* machine, const cel0_Value* constants);
+/* Returned by compiled code after replacing its frame for a tail call. */
+#define cel0_ValueType_TailCall 4
+
+typedef struct cel0_CompiledForm {
+  int codes_size;
+  const cel0_CompiledCode* codes;
+  /* Checked against the runtime's compilation of the form. */
+  const int* instructions_sizes;
+} cel0_CompiledForm;
 
-void cel0_printValue(cel0_Value* value, FILE* fd);
+/* Evaluates source, which holds forms_size forms, and prints each result. */
+int cel0_runCompiled(const char* source, const cel0_CompiledForm* forms, int forms_size);
 
-cel0_Value* cel0_eval(cel0_Value* value);
+/* Each executes the instruction at pc of the top frame as the
+   interpreter would. Calls return a panic unwound through the callee's
+   frames, which the caller unwinds through its own with cel0_unwind. */
+void cel0_safepoint(void);
+cel0_Value* cel0_registers(struct cel0_Machine* machine);
+cel0_Value cel0_loadNativeName(struct cel0_Machine* machine, int pc);
+cel0_Value cel0_callNative(struct cel0_Machine* machine, int pc);
+cel0_Value cel0_call(struct cel0_Machine* machine, int pc);
+cel0_Value cel0_tailCall(struct cel0_Machine* machine, int pc);
+cel0_Value cel0_makeClosure(struct cel0_Machine* machine, int pc);
+char cel0_testParallel(void);
+cel0_Value cel0_parallelCall(struct cel0_Machine* machine, int pc);
+/* The panic of a Panic instruction, or of a Test on a non-symbol. */
+cel0_Value cel0_panic(struct cel0_Machine* machine, int pc);
+cel0_Value cel0_unwind(struct cel0_Machine* machine, int pc, cel0_Value panic);
+cel0_Value cel0_return(struct cel0_Machine* machine, cel0_Value value);
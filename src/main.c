@@ -1,29 +1,172 @@
-#include <assert.h>
-#include <string.h>
+#include <errno.h>
+#include <signal.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
 
 #include "cel0.h"
 
+static void evalImage(cel0_Context* context, cel0_Image* image, FILE* out) {
+  struct cel0_Value* parsed;
+  while ((parsed = cel0_readImage(image))) {
+    struct cel0_Value* evaluated = parsed->type == cel0_ValueType_Panic ? parsed : cel0_eval(context, parsed);
+    cel0_printValue(context, evaluated, out);
+    fprintf(out, "\n");
+    fflush(out);
+  }
+}
+
+static int compileImage(cel0_Context* context, char* path) {
+  FILE* out = fopen(path, "wb");
+  if (!out) {
+    perror(path);
+    return 1;
+  }
+  cel0_Reader* reader = cel0_createReader(context, stdin);
+  int status = cel0_writeImage(reader, out);
+  cel0_destroyReader(reader);
+  if (fclose(out) != 0 || status != 0) {
+    perror(path);
+    return 1;
+  }
+  return 0;
+}
+
+static void evalStream(cel0_Context* context, FILE* in, FILE* out) {
+  cel0_Reader* reader = cel0_createReader(context, in);
+  struct cel0_Value* parsed;
+  while ((parsed = cel0_read(reader))) {
+    struct cel0_Value* evaluated = parsed->type == cel0_ValueType_Panic ? parsed : cel0_eval(context, parsed);
+    cel0_printValue(context, evaluated, out);
+    fprintf(out, "\n");
+    fflush(out);
+  }
+  cel0_destroyReader(reader);
+}
+
+/* Batch mode reads programs framed as "<length>\n<program>" and answers
+   each with its result framed the same way, reusing one interpreter. A
+   program of several forms answers with the result of its last form, or
+   of the first one that panics. */
+static void evalFramedStream(cel0_Context* context, FILE* in, FILE* out) {
+  int length;
+  while (fscanf(in, "%d", &length) == 1 && fgetc(in) == '\n' && length >= 0) {
+    char* program = malloc(length + 1);
+    if (!program || fread(program, 1, length, in) != (size_t)length) {
+      free(program);
+      return;
+    }
+    program[length] = 0;
+
+    FILE* program_file = fmemopen(program, length, "r");
+    cel0_Reader* reader = cel0_createReader(context, program_file);
+    struct cel0_Value* parsed;
+    struct cel0_Value* evaluated = 0;
+    while ((parsed = cel0_read(reader))) {
+      evaluated = parsed->type == cel0_ValueType_Panic ? parsed : cel0_eval(context, parsed);
+      if (evaluated->type == cel0_ValueType_Panic) break;
+    }
+    char* result = 0;
+    size_t result_size = 0;
+    FILE* result_file = open_memstream(&result, &result_size);
+    if (!evaluated) fprintf(result_file, "<empty-program>");
+    else cel0_printValue(context, evaluated, result_file);
+    fclose(result_file);
+    cel0_destroyReader(reader);
+    fclose(program_file);
+    free(program);
+
+    /* A client that went away ends the stream. */
+    char sent = fprintf(out, "%zu\n", result_size) > 0 &&
+      fwrite(result, 1, result_size, out) == result_size && fflush(out) == 0;
+    free(result);
+    if (!sent) return;
+  }
+}
+
+static int serveSocket(cel0_Context* context, char* path) {
+  int server = socket(AF_UNIX, SOCK_STREAM, 0);
+  struct sockaddr_un address = { .sun_family = AF_UNIX };
+  if (server < 0 || strlen(path) >= sizeof(address.sun_path)) {
+    perror("socket");
+    return 1;
+  }
+  strcpy(address.sun_path, path);
+  unlink(path);
+  if (bind(server, (struct sockaddr*)&address, sizeof(address)) != 0 || listen(server, 16) != 0) {
+    perror("bind");
+    return 1;
+  }
+  /* Replies to clients that disconnected fail instead of killing us. */
+  signal(SIGPIPE, SIG_IGN);
+  for (;;) {
+    int connection = accept(server, 0, 0);
+    if (connection < 0) {
+      if (errno == EINTR || errno == ECONNABORTED) continue;
+      perror("accept");
+      if (errno != EMFILE && errno != ENFILE && errno != ENOBUFS && errno != ENOMEM) return 1;
+      /* Out of descriptors or memory, until some connection closes. */
+      sleep(1);
+      continue;
+    }
+    int duplicate = dup(connection);
+    FILE* in = fdopen(connection, "r");
+    FILE* out = duplicate < 0 ? 0 : fdopen(duplicate, "w");
+    if (in && out) evalFramedStream(context, in, out);
+    if (in) fclose(in);
+    else close(connection);
+    if (out) fclose(out);
+    else if (duplicate >= 0) close(duplicate);
+  }
+}
+
 int main(int argc, char* argv[]) {
-  (void)argc; (void)argv;
-
-  int input_size = 1024;
-  char* input = malloc(1024);
-  assert(input);
-  int chars_read = 0;
-  do {
-    fgets(input + chars_read, input_size - chars_read, stdin);
-    chars_read += strlen(input + chars_read);
-    if (chars_read == input_size - 1) {
-      input_size *= 2;
-      input = realloc(input, input_size);
-      assert(input);
+  cel0_Context* context = cel0_createContext();
+  int status = 0;
+  char mem_stats = argc > 1 && strcmp(argv[1], "--mem-stats") == 0;
+  if (mem_stats) {
+    argv[1] = argv[0];
+    argv++;
+    argc--;
+  }
+  if (argc == 2 && strcmp(argv[1], "--batch") == 0) {
+    evalFramedStream(context, stdin, stdout);
+  } else if (argc == 3 && strcmp(argv[1], "--socket") == 0) {
+    status = serveSocket(context, argv[2]);
+  } else if (argc == 3 && strcmp(argv[1], "--compile-image") == 0) {
+    status = compileImage(context, argv[2]);
+  } else if (argc == 3 && strcmp(argv[1], "--image") == 0) {
+    cel0_Image* image = cel0_openImage(context, argv[2]);
+    if (image) {
+      evalImage(context, image, stdout);
+      cel0_closeImage(image);
+    } else {
+      fprintf(stderr, "%s: cannot load image\n", argv[2]);
+      status = 1;
+    }
+  } else if (argc == 3 && strcmp(argv[1], "--profile") == 0) {
+    cel0_startProfile(context);
+    evalStream(context, stdin, stdout);
+    FILE* folded = fopen(argv[2], "w");
+    if (folded) {
+      cel0_writeProfile(context, stderr, folded);
+      fclose(folded);
+    } else {
+      perror(argv[2]);
+      status = 1;
     }
-  } while(!feof(stdin));
-  
-  struct cel0_Value* parsed = cel0_parse(input);
-  struct cel0_Value* evaluated = cel0_eval(parsed);    
-  cel0_printValue(evaluated, stdout);
-  printf("\n");
+  } else if (argc == 2 && strcmp(argv[1], "--emit-c") == 0) {
+    cel0_emitC(context, stdin, stdout);
+  } else if (argc == 1) {
+    evalStream(context, stdin, stdout);
+  } else {
+    fprintf(stderr, "usage: %s [--mem-stats] [--batch | --socket path | --emit-c | --compile-image path | --image path | --profile folded-path]\n", argv[0]);
+    status = 1;
+  }
+  if (mem_stats) cel0_printMemoryStats(context, stderr);
+  cel0_destroyContext(context);
+  return status;
 }
@@ -0,0 +1,12 @@
+#!/bin/sh
+# Feeds framed programs to cel0 $1 --batch and checks the framed results.
+frame() {
+  printf '%d\n%s' "${#1}" "$1"
+}
+expected=$(frame '3'; frame '8'; frame '<empty-program>'; frame '<out-of-bounds (nth 5 (1))>'; frame '7')
+[ "$({ frame '(add 1 2)'
+       frame '(vec 8 10)
+(bind (fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (add (fib (add n -1)) (fib (add n -2))))))) (fib 6))'
+       frame ''
+       frame '(nth 5 (vec 1)) (add 1 2)'
+       frame '(add 3 4)'; } | "$1" --batch)" = "$expected" ]
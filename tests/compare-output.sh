@@ -0,0 +1,3 @@
+#!/bin/sh
+# Runs $1 and compares what it prints with the contents of $2.
+[ "$("$1")" = "$(cat "$2")" ]
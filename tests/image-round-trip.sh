@@ -0,0 +1,6 @@
+#!/bin/sh
+# Compiles the program $2 to an image with cel0 $1, runs the image and
+# compares what it prints with the contents of $3.
+image=$(mktemp) || exit 1
+trap 'rm -f "$image"' EXIT
+"$1" --compile-image "$image" < "$2" && [ "$("$1" --image "$image")" = "$(cat "$3")" ]
@@ -0,0 +1,105 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../src/cel0.h"
+
+/* Evaluates the same programs on several threads at once, each with its own
+   context, and checks every thread gets the sequential results. */
+#define THREADS 8
+#define ROUNDS 50
+
+static char* programs[][2] = {
+  { "(bind (fib (lambda (n) (if (eq n 0) 0 (if (eq n 1) 1 (add (fib (add n -1)) (fib (add n -2))))))) (fib 15))", "610" },
+  { "(bind (loop (lambda (n acc) (if (eq n 0) acc (loop (add n -1) (append acc (vec n (quote a-symbol-only-this-program-uses))))))) (length (loop 3000 (vec))))", "3000" },
+  { "(bind (f (lambda (x) (vec x (quote y)))) (f 7))", "(7 y)" },
+  { "(nth 3 (vec 1 2))", "<out-of-bounds (nth 3 (1 2))>" },
+};
+
+static void* evalPrograms(void* failures) {
+  cel0_Context* context = cel0_createContext();
+  for (int round=0; round<ROUNDS; round++) {
+    for (unsigned i=0; i<sizeof(programs)/sizeof(programs[0]); i++) {
+      char* result = 0;
+      size_t result_size = 0;
+      FILE* result_file = open_memstream(&result, &result_size);
+      cel0_printValue(context, cel0_eval(context, cel0_parse(context, programs[i][0])), result_file);
+      fclose(result_file);
+      if (strcmp(result, programs[i][1]) != 0) {
+	fprintf(stderr, "expected %s, got %s\n", programs[i][1], result);
+	(*(int*)failures)++;
+      }
+      free(result);
+    }
+  }
+  cel0_destroyContext(context);
+  return 0;
+}
+
+/* Within one context, one element of a pmap widens a mapped vector, as
+   vadd does, while the others read its bytes. */
+#define WIDEN_ROUNDS 20
+#define WIDEN_SIZE (1<<16)
+#define WIDEN_ELEMENTS 64
+
+static int widenWhileReading() {
+  char path[] = "/tmp/cel0-threads-XXXXXX";
+  int file = mkstemp(path);
+  if (file < 0) {
+    perror("mkstemp");
+    return 1;
+  }
+  unsigned char bytes[WIDEN_SIZE];
+  unsigned sum = 0;
+  for (int i=0; i<WIDEN_SIZE; i++) {
+    bytes[i] = i * 7 % 256;
+    sum += bytes[i];
+  }
+  int written = write(file, bytes, WIDEN_SIZE) == WIDEN_SIZE;
+  close(file);
+  unsigned expected = 2 * sum;
+  for (int i=1; i<WIDEN_ELEMENTS; i++)
+    expected += bytes[i] + sum;
+  char program[512], expected_result[16];
+  snprintf(program, sizeof(program),
+	   "(bind (bytes (open-file! (quote %s)))"
+	   " (vsum (pmap (lambda (i) (if (eq i 0) (vsum (vadd bytes bytes)) (add (nth i bytes) (vsum bytes))))"
+	   " (range 0 %d))))", path, WIDEN_ELEMENTS);
+  snprintf(expected_result, sizeof(expected_result), "%d", (int)expected);
+
+  setenv("CEL0_THREADS", "4", 1);
+  cel0_Context* context = cel0_createContext();
+  int failures = !written;
+  for (int round=0; round<WIDEN_ROUNDS; round++) {
+    char* result = 0;
+    size_t result_size = 0;
+    FILE* result_file = open_memstream(&result, &result_size);
+    cel0_printValue(context, cel0_eval(context, cel0_parse(context, program)), result_file);
+    fclose(result_file);
+    if (strcmp(result, expected_result) != 0) {
+      fprintf(stderr, "expected %s, got %s\n", expected_result, result);
+      failures++;
+    }
+    free(result);
+  }
+  cel0_destroyContext(context);
+  unlink(path);
+  return failures;
+}
+
+int main() {
+  pthread_t threads[THREADS];
+  int failures[THREADS] = { 0 };
+  for (int i=0; i<THREADS; i++)
+    pthread_create(threads + i, 0, evalPrograms, failures + i);
+  int total = 0;
+  for (int i=0; i<THREADS; i++) {
+    pthread_join(threads[i], 0);
+    total += failures[i];
+  }
+  total += widenWhileReading();
+  printf("%d failures\n", total);
+  return total != 0;
+}